@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <zee.hpp>
+#include <zephany.hpp>
+
+using namespace Zephany;
+
+using TVal = float;
+using TIdx = unsigned int;
+
+/* The rate of dense products on the device, C = A * B for matrices of
+ * size n with inner blocks of size b, for both schedules of Cannon's
+ * algorithm. The best of a few runs is reported, the first one also starts
+ * the system, together with the tile size and the bytes that are moved
+ * between external memory and the cores. Rectangular products are compared
+ * with the same products padded to square matrices. */
+int main() {
+    struct Case {
+        TIdx size;
+        TIdx innerBlockSize;
+    };
+    std::vector<Case> cases = {{128, 16}, {256, 16}, {512, 16}, {256, 8},
+                               {512, 8},  {200, 25}, {400, 25}, {216, 27},
+                               {432, 27}};
+
+    std::cout << "n, inner block size, schedule, tile size, bytes down, "
+                 "bytes up, seconds, GFLOP/s\n";
+    for (auto c : cases) {
+        DStreamingMatrix<TVal, TIdx> A(c.innerBlockSize, c.size);
+        DStreamingMatrix<TVal, TIdx> B(c.innerBlockSize, c.size);
+        A.generate([](TIdx i, TIdx j) { return (TVal)((i + j) % 7); });
+        B.generate([](TIdx i, TIdx j) { return (TVal)((i * j) % 5); });
+
+        for (auto schedule :
+             {cannon_schedule::outer_blocks, cannon_schedule::tiles}) {
+            setCannonSchedule(schedule);
+            auto plan = planCannon<TVal>(
+                c.innerBlockSize, A.getStream().getOuterRows(), schedule);
+
+            double best = 0.0;
+            for (int r = 0; r < 3; ++r) {
+                auto start = std::chrono::steady_clock::now();
+                DStreamingMatrix<TVal, TIdx> C(c.innerBlockSize, c.size);
+                C = A * B;
+                double seconds = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count();
+                best = r == 0 ? seconds : std::min(best, seconds);
+            }
+
+            double flops = 2.0 * c.size * c.size * c.size;
+            std::cout << c.size << ", " << c.innerBlockSize << ", "
+                      << (schedule == cannon_schedule::tiles ? "tiles"
+                                                             : "outer blocks")
+                      << ", " << plan.tileRows << " x " << plan.tileCols
+                      << ", " << plan.bytesDown
+                      << ", " << plan.bytesUp << ", " << best << ", "
+                      << flops / best * 1e-9 << "\n";
+        }
+    }
+
+    struct Shape {
+        TIdx m;
+        TIdx k;
+        TIdx n;
+    };
+    std::vector<Shape> shapes = {{512, 128, 512}, {512, 512, 64},
+                                 {128, 512, 256}};
+    const TIdx innerBlockSize = 16;
+    setCannonSchedule(cannon_schedule::tiles);
+
+    std::cout << "\nm, k, n, padded, seconds, GFLOP/s\n";
+    for (auto shape : shapes) {
+        for (bool padded : {false, true}) {
+            TIdx size = std::max({shape.m, shape.k, shape.n});
+            TIdx m = padded ? size : shape.m;
+            TIdx k = padded ? size : shape.k;
+            TIdx n = padded ? size : shape.n;
+            DStreamingMatrix<TVal, TIdx> A(innerBlockSize, m, k);
+            DStreamingMatrix<TVal, TIdx> B(innerBlockSize, k, n);
+            A.generate([&](TIdx i, TIdx j) {
+                return (i < shape.m && j < shape.k) ? (TVal)((i + j) % 7)
+                                                    : (TVal)0;
+            });
+            B.generate([&](TIdx i, TIdx j) {
+                return (i < shape.k && j < shape.n) ? (TVal)((i * j) % 5)
+                                                    : (TVal)0;
+            });
+
+            double best = 0.0;
+            for (int r = 0; r < 3; ++r) {
+                auto start = std::chrono::steady_clock::now();
+                DStreamingMatrix<TVal, TIdx> C(innerBlockSize, m, n);
+                C = A * B;
+                double seconds = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count();
+                best = r == 0 ? seconds : std::min(best, seconds);
+            }
+
+            // the rate of the useful flops of the unpadded product
+            double flops = 2.0 * shape.m * shape.k * shape.n;
+            std::cout << shape.m << ", " << shape.k << ", " << shape.n << ", "
+                      << (padded ? "yes" : "no") << ", " << best << ", "
+                      << flops / best * 1e-9 << "\n";
+        }
+    }
+
+    Session::instance().end();
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../kernels/matrix_multiply_add.h"
+
+// The multiply-add that k_cannon used before, for reference
+void naiveMultiplyAdd(const float* A, const float* B, float* C, int n) {
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; j++)
+            for (int k = 0; k < n; k++)
+                C[i * n + j] += A[i * n + k] * B[k * n + j];
+}
+
+// The rate in GFLOP/s of C += A B, repeated until a tenth of a second passed
+template <typename TMultiplyAdd>
+double rate(TMultiplyAdd multiplyAdd, const std::vector<float>& A,
+            const std::vector<float>& B, std::vector<float>& C, int n) {
+    long repetitions = 0;
+    double seconds = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    while (seconds < 0.1) {
+        for (int r = 0; r < 100; ++r)
+            multiplyAdd(A.data(), B.data(), C.data(), n);
+        repetitions += 100;
+        seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    }
+    return 2.0 * n * n * n * repetitions / seconds * 1e-9;
+}
+
+// The multiply-add with the size known at compile time, like the variants of
+// k_cannon that are compiled for a fixed inner block size
+template <int size>
+void fixedMultiplyAdd(const float* A, const float* B, float* C, int) {
+    matrix_multiply_add(A, B, C, size);
+}
+
+// The rate of the fixed size multiply-add, or zero if there is no variant
+double fixedRate(const std::vector<float>& A, const std::vector<float>& B,
+                 std::vector<float>& C, int n) {
+    switch (n) {
+    case 8:
+        return rate(fixedMultiplyAdd<8>, A, B, C, n);
+    case 16:
+        return rate(fixedMultiplyAdd<16>, A, B, C, n);
+    case 24:
+        return rate(fixedMultiplyAdd<24>, A, B, C, n);
+    }
+    return 0.0;
+}
+
+/* Compares the register tiled multiply-add of the Cannon kernel with the
+ * naive triple loop, natively on the host, for a range of inner block
+ * sizes, and with the sizes for which k_cannon has a variant also with a
+ * fixed size. The results are checked against the naive version. */
+int main() {
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+
+    bool correct = true;
+    std::cout << "inner block size, naive GFLOP/s, tiled GFLOP/s, speedup, "
+                 "fixed size GFLOP/s, max relative error\n";
+    for (int n : {4, 5, 8, 10, 13, 16, 20, 24, 25, 30, 32}) {
+        std::vector<float> A(n * n);
+        std::vector<float> B(n * n);
+        std::vector<float> C(n * n);
+        for (auto& x : A)
+            x = value(generator);
+        for (auto& x : B)
+            x = value(generator);
+        for (auto& x : C)
+            x = value(generator);
+
+        auto expected = C;
+        auto result = C;
+        naiveMultiplyAdd(A.data(), B.data(), expected.data(), n);
+        matrix_multiply_add(A.data(), B.data(), result.data(), n);
+
+        double error = 0.0;
+        for (int i = 0; i < n * n; ++i)
+            error = std::max(error, (double)std::abs(result[i] - expected[i]) /
+                                        std::max(1.0f, std::abs(expected[i])));
+        correct = correct && error < 1e-5;
+
+        double naive = rate(naiveMultiplyAdd, A, B, C, n);
+        double tiled = rate(
+            [](const float* a, const float* b, float* c, int size) {
+                matrix_multiply_add(a, b, c, size);
+            },
+            A, B, C, n);
+
+        std::cout << n << ", " << naive << ", " << tiled << ", "
+                  << tiled / naive << ", " << fixedRate(A, B, C, n) << ", "
+                  << error << "\n";
+    }
+
+    if (!correct) {
+        std::cout << "the tiled multiply-add differs from the naive one\n";
+        return 1;
+    }
+
+    return 0;
+}
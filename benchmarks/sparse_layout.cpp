@@ -0,0 +1,160 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <zee.hpp>
+#include <zephany.hpp>
+
+using namespace Zephany;
+
+using TVal = float;
+using TIdx = unsigned int;
+using TVector = DStreamingVector<TVal, TIdx>;
+using TMatrix = DStreamingSparseMatrix<TVal, TIdx>;
+
+// A square matrix with nonzeros in a band of the given width around the
+// diagonal, or anywhere when the band is as wide as the matrix
+void bandMatrix(TMatrix& A, TVector& v, TIdx size, TIdx nonZeros,
+                TIdx band) {
+    std::mt19937 generator(1234);
+    std::uniform_int_distribution<TIdx> index(0, size - 1);
+    std::uniform_int_distribution<TIdx> offset(0, band - 1);
+    std::uniform_real_distribution<TVal> value(-1.0f, 1.0f);
+
+    std::vector<std::unique_ptr<TMatrix::image_type>> images;
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        images.emplace_back(new TMatrix::image_type());
+
+    for (TIdx k = 0; k < nonZeros; ++k) {
+        TIdx row = index(generator);
+        TIdx col = (row + size - band / 2 + offset(generator)) % size;
+        images[k % stream_config::processors]->pushTriplet(
+            Triplet<TVal, TIdx>(row, col, value(generator)));
+    }
+    A.resetImages(images);
+
+    for (TIdx i = 0; i < size; ++i)
+        v.reassign(i, i % stream_config::processors);
+}
+
+template <typename TIndex>
+TIdx localIndex(const char* indices, TIdx i) {
+    TIndex result;
+    memcpy(&result, indices + i * sizeof(TIndex), sizeof(TIndex));
+    return result;
+}
+
+// Runs the inner loop of k_spmv over every window of a processor stream,
+// with the non-local components of v taken to be zero
+template <typename TIndex>
+void multiplyWindows(const char* stream, std::vector<TVal>& v,
+                     std::vector<TVal>& u) {
+    int size = 0;
+    auto next = [&]() {
+        stream += size;
+        memcpy(&size, stream, sizeof(int));
+        stream += sizeof(int);
+        return (const std::uint32_t*)stream;
+    };
+
+    auto header = next();
+    const bool csr = header[6] == 1;
+    const TIdx strips = header[4];
+    for (TIdx strip = 0; strip < strips; ++strip) {
+        const TIdx windows = next()[0];
+        for (TIdx window = 0; window < windows; ++window) {
+            auto chunk = next();
+            TIdx cursor = 0;
+            const TIdx sizeU = chunk[cursor++];
+            const TIdx windowSize = chunk[cursor++];
+
+            const TIdx rowEntries = csr ? sizeU + 1 : windowSize;
+            auto rows = (const char*)&chunk[cursor];
+            auto cols = rows + rowEntries * sizeof(TIndex);
+            cursor += ((rowEntries + windowSize) * sizeof(TIndex) + 3) / 4;
+            auto vals = (const TVal*)&chunk[cursor];
+
+            if (csr) {
+                for (TIdx row = 0; row < sizeU; ++row) {
+                    TIdx end = localIndex<TIndex>(rows, row + 1);
+                    TVal sum = 0.0f;
+                    for (TIdx idx = localIndex<TIndex>(rows, row); idx < end;
+                         ++idx)
+                        sum += v[localIndex<TIndex>(cols, idx)] * vals[idx];
+                    u[row] = sum;
+                }
+            } else {
+                for (TIdx row = 0; row < sizeU; ++row)
+                    u[row] = 0.0f;
+                for (TIdx idx = 0; idx < windowSize; ++idx)
+                    u[localIndex<TIndex>(rows, idx)] +=
+                        v[localIndex<TIndex>(cols, idx)] * vals[idx];
+            }
+        }
+    }
+}
+
+int main() {
+    struct Case {
+        const char* name;
+        TIdx size;
+        TIdx nonZeros;
+        TIdx band;
+    };
+
+    const TIdx stripSize = 128;
+    const TIdx windowSize = 128;
+
+    std::vector<Case> cases = {{"random sparse", 20000, 200000, 20000},
+                               {"random dense", 4000, 1000000, 4000},
+                               {"narrow band", 20000, 1000000, 64},
+                               {"wide band", 20000, 1000000, 1024}};
+
+    std::cout << "matrix, layout, bytes per nonzero, nonzeros per second\n";
+    for (auto& c : cases) {
+        TMatrix A(c.size, c.size);
+        TVector v(c.size, 1.0);
+        bandMatrix(A, v, c.size, c.nonZeros, c.band);
+
+        for (auto layout : {window_layout::triplets, window_layout::csr}) {
+            SparseStream<TMatrix, TVector> stream(A, v, stripSize,
+                                                  windowSize);
+            stream.setLayout(layout);
+            stream.prepareStream();
+
+            std::size_t bytes = 0;
+            for (TIdx s = 0; s < stream_config::processors; ++s)
+                bytes += stream.getRawStreamSize(s);
+
+            std::vector<TVal> localV(2 * stripSize, 1.0f);
+            std::vector<TVal> localU(windowSize, 0.0f);
+            const int repetitions = 10;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repetitions; ++r) {
+                for (TIdx s = 0; s < stream_config::processors; ++s) {
+                    if (stream.localIndexBytes() == sizeof(uint16_t))
+                        multiplyWindows<uint16_t>(stream.getRawStream(s),
+                                                  localV, localU);
+                    else
+                        multiplyWindows<std::uint32_t>(
+                            stream.getRawStream(s), localV, localU);
+                }
+            }
+            double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count() /
+                             repetitions;
+
+            std::cout << c.name << ", "
+                      << (layout == window_layout::csr ? "csr" : "triplets")
+                      << ", " << (double)bytes / c.nonZeros << ", "
+                      << c.nonZeros / seconds << "\n";
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <zee.hpp>
+#include <zephany.hpp>
+
+using namespace Zephany;
+
+using TVal = float;
+using TIdx = unsigned int;
+using TVector = DStreamingVector<TVal, TIdx>;
+using TMatrix = DStreamingSparseMatrix<TVal, TIdx>;
+
+// A square matrix with uniformly distributed nonzeros
+void randomMatrix(TMatrix& A, TIdx size, TIdx nonZeros) {
+    std::mt19937 generator(1234);
+    std::uniform_int_distribution<TIdx> index(0, size - 1);
+    std::uniform_real_distribution<TVal> value(-1.0f, 1.0f);
+
+    std::vector<std::unique_ptr<TMatrix::image_type>> images;
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        images.emplace_back(new TMatrix::image_type());
+
+    for (TIdx k = 0; k < nonZeros; ++k) {
+        images[k % stream_config::processors]->pushTriplet(
+            Triplet<TVal, TIdx>(index(generator), index(generator),
+                                value(generator)));
+    }
+    A.resetImages(images);
+}
+
+/* Multiplies a sparse matrix by k vectors, once with k products and once
+ * with a single SpMM, and reports the bytes that are streamed down and up in
+ * total and the time per product. The bytes are only counted on the
+ * emulator, on the device they are reported as zero. */
+int main() {
+    const TIdx size = 4000;
+    const TIdx nonZeros = 40000;
+    const TIdx stripSize = 128;
+    const TIdx windowSize = 128;
+
+    TMatrix A(size, size);
+    randomMatrix(A, size, nonZeros);
+
+    TVector v(size, 1.0);
+    for (TIdx j = 0; j < size; ++j)
+        v.reassign(j, j % stream_config::processors);
+
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream();
+
+    std::cout << "vectors, method, bytes down, bytes up, seconds\n";
+    for (TIdx k : {1, 2, 4, 8}) {
+        std::vector<TVector> X(k, v);
+        for (TIdx j = 0; j < k; ++j)
+            for (TIdx i = 0; i < size; ++i)
+                X[j].at(i) = (TVal)(i % (j + 2));
+
+        unsigned long long bytesDown = 0;
+        unsigned long long bytesUp = 0;
+        auto start = std::chrono::steady_clock::now();
+        TVector u(size);
+        for (TIdx j = 0; j < k; ++j) {
+            u = A * X[j];
+#ifdef EBSP_EMULATOR
+            auto statistics = ebsp_emu_get_statistics();
+            bytesDown += statistics.bytes_down;
+            bytesUp += statistics.bytes_up;
+#endif
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::cout << k << ", spmv, " << bytesDown << ", " << bytesUp << ", "
+                  << seconds << "\n";
+
+        start = std::chrono::steady_clock::now();
+        auto U = spmm(A, X);
+        seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+        bytesDown = 0;
+        bytesUp = 0;
+#ifdef EBSP_EMULATOR
+        auto statistics = ebsp_emu_get_statistics();
+        bytesDown = statistics.bytes_down;
+        bytesUp = statistics.bytes_up;
+#endif
+        std::cout << k << ", spmm, " << bytesDown << ", " << bytesUp << ", "
+                  << seconds << "\n";
+    }
+
+    Session::instance().end();
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zee.hpp>
+#include <zephany.hpp>
+
+using namespace Zephany;
+
+using TVal = float;
+using TIdx = unsigned int;
+using TVector = DStreamingVector<TVal, TIdx>;
+using TMatrix = DStreamingSparseMatrix<TVal, TIdx>;
+
+// A square matrix whose nonzeros are concentrated in a few rows and columns,
+// the degrees follow a power law with the given exponent
+void skewedMatrix(TMatrix& A, TIdx size, TIdx nonZeros, double exponent) {
+    std::mt19937 generator(1234);
+    std::vector<double> weights(size);
+    for (TIdx i = 0; i < size; ++i)
+        weights[i] = std::pow(i + 1.0, -exponent);
+    std::discrete_distribution<TIdx> index(weights.begin(), weights.end());
+    std::uniform_real_distribution<TVal> value(-1.0f, 1.0f);
+
+    std::vector<std::unique_ptr<TMatrix::image_type>> images;
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        images.emplace_back(new TMatrix::image_type());
+
+    for (TIdx k = 0; k < nonZeros; ++k) {
+        images[k % stream_config::processors]->pushTriplet(
+            Triplet<TVal, TIdx>(index(generator), index(generator),
+                                value(generator)));
+    }
+    A.resetImages(images);
+}
+
+// v is distributed cyclically in blocks of the given size
+void report(const std::string& name, TMatrix& A, TIdx stripSize,
+            TIdx windowSize, TIdx block = 1) {
+    TVector v(A.getCols(), 1.0);
+    for (TIdx j = 0; j < A.getCols(); ++j)
+        v.reassign(j, (j / block) % stream_config::processors);
+
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream();
+
+    TVector u(A.getRows());
+    u = A * v;
+
+    // the counts are only kept by the emulator, on the device they are zero
+    unsigned long long countedDown = 0;
+    unsigned long long countedUp = 0;
+    unsigned long long countedBarriers = 0;
+    unsigned long long countedGets = 0;
+#ifdef EBSP_EMULATOR
+    auto statistics = ebsp_emu_get_statistics();
+    countedDown = statistics.chunks_down;
+    countedUp = statistics.chunks_up;
+    countedBarriers = statistics.barriers;
+    countedGets = statistics.hpgets;
+#endif
+
+    // every (strip, window) pair had a chunk, an up chunk and a barrier
+    // when empty windows were not left out
+    const unsigned long long P = stream_config::processors;
+    const unsigned long long strips = (A.getCols() - 1) / stripSize + 1;
+    const unsigned long long windows = (A.getRows() - 1) / windowSize + 1;
+    const unsigned long long chunksDown = P * (1 + strips * (2 + windows));
+    const unsigned long long chunksUp = P * strips * windows;
+    const unsigned long long barriers = P * strips * (1 + windows);
+
+    auto fetches = stream.getFetchStatistics();
+
+    std::cout << name << ", " << block << ", " << A.nonZeros() << ", "
+              << countedDown << " / " << chunksDown << ", " << countedUp
+              << " / " << chunksUp << ", " << countedBarriers << " / "
+              << barriers << ", " << countedGets << " / "
+              << fetches.components << ", "
+              << fetches.averageRunLength() << "\n";
+}
+
+/* Counts the chunks, barriers and transfers of an SpMV on the emulator,
+ * compared to the counts with a chunk for every window and a transfer for
+ * every non-local component. Matrix market files can be passed as
+ * arguments, otherwise random matrices with skewed degrees are used. */
+int main(int argc, char** argv) {
+    const TIdx stripSize = 64;
+    const TIdx windowSize = 64;
+
+    std::cout << "matrix, v block size, nonzeros, chunks down, chunks up, "
+                 "barriers (with / without elision), transfers / non-local "
+                 "components, average run length\n";
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            TMatrix A(argv[i], stream_config::processors);
+            report(argv[i], A, stripSize, windowSize);
+        }
+        Session::instance().end();
+        return 0;
+    }
+
+    struct Case {
+        const char* name;
+        TIdx size;
+        TIdx nonZeros;
+        double exponent;
+    };
+
+    std::vector<Case> cases = {{"uniform", 4000, 40000, 0.0},
+                               {"skewed", 4000, 40000, 0.8},
+                               {"very skewed", 4000, 40000, 1.2}};
+
+    for (auto& c : cases) {
+        TMatrix A(c.size, c.size);
+        skewedMatrix(A, c.size, c.nonZeros, c.exponent);
+        report(c.name, A, stripSize, windowSize);
+        report(c.name, A, stripSize, windowSize, 4);
+    }
+
+    Session::instance().end();
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <zee.hpp>
+#include <zephany.hpp>
+
+using namespace Zephany;
+
+using TVal = float;
+using TIdx = unsigned int;
+using TVector = DStreamingVector<TVal, TIdx>;
+using TMatrix = DStreamingSparseMatrix<TVal, TIdx>;
+
+// A random square matrix with a cyclic distribution of the nonzeros, and a
+// cyclic distribution of the vector
+void randomMatrix(TMatrix& A, TVector& v, TIdx size, TIdx nonZeros) {
+    std::mt19937 generator(1234);
+    std::uniform_int_distribution<TIdx> index(0, size - 1);
+    std::uniform_real_distribution<TVal> value(-1.0f, 1.0f);
+
+    std::vector<std::unique_ptr<TMatrix::image_type>> images;
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        images.emplace_back(new TMatrix::image_type());
+
+    for (TIdx k = 0; k < nonZeros; ++k) {
+        images[k % stream_config::processors]->pushTriplet(
+            Triplet<TVal, TIdx>(index(generator), index(generator),
+                                value(generator)));
+    }
+    A.resetImages(images);
+
+    for (TIdx i = 0; i < size; ++i)
+        v.reassign(i, i % stream_config::processors);
+}
+
+int main() {
+    struct Case {
+        const char* name;
+        TIdx size;
+        TIdx nonZeros;
+        TIdx stripSize;
+        TIdx windowSize;
+    };
+
+    // steam3 is 80 x 80 with 928 nonzeros
+    std::vector<Case> cases = {{"steam3-class", 80, 928, 50, 50},
+                               {"medium", 10000, 200000, 250, 250},
+                               {"large", 20000, 1000000, 250, 250}};
+
+    char directory[] = "/tmp/zephany_benchmarkXXXXXX";
+    if (!mkdtemp(directory))
+        return 1;
+
+    std::cout << "matrix, size, nonzeros, seconds, nonzeros per second, "
+                 "seconds from cache\n";
+    for (auto& c : cases) {
+        TMatrix A(c.size, c.size);
+        TVector v(c.size, 1.0);
+        randomMatrix(A, v, c.size, c.nonZeros);
+
+        const int repetitions = c.nonZeros < 100000 ? 100 : 3;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repetitions; ++r) {
+            SparseStream<TMatrix, TVector> stream(A, v, c.stripSize,
+                                                  c.windowSize);
+            stream.prepareStream();
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count() /
+                         repetitions;
+
+        // the first stream is written to the cache, the second is loaded
+        SparseStream<TMatrix, TVector> cached(A, v, c.stripSize,
+                                              c.windowSize);
+        cached.prepareStream(directory);
+        start = std::chrono::steady_clock::now();
+        SparseStream<TMatrix, TVector> loaded(A, v, c.stripSize,
+                                              c.windowSize);
+        loaded.prepareStream(directory);
+        double cachedSeconds = std::chrono::duration<double>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+
+        std::cout << c.name << ", " << c.size << ", " << c.nonZeros << ", "
+                  << seconds << ", " << c.nonZeros / seconds << ", "
+                  << cachedSeconds << "\n";
+    }
+
+    std::system((std::string("rm -r ") + directory).c_str());
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+File: emulator/include/e_bsp.h
+
+This file is part of the Zephany; linear algebra library for the Epiphany
+
+Copyright (C) 2015 Jan-Willem Buurlage <janwillembuurlage@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License (LGPL)
+as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+*/
+
+/* Native stand-in for the Epiphany side of Epiphany BSP.
+ *
+ * A kernel compiled against this header becomes a shared object that is run
+ * by the emulator on one thread per core. Every core has its own stack, but
+ * global variables are shared between the cores, so kernels should keep
+ * their state local to main (which all current Zephany kernels do). */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The host and the cores share an address space in the emulator, so the
+ * core functions that clash with host_bsp are renamed. The kernel entry
+ * point is renamed so that the emulator can look it up. */
+#define bsp_begin ebsp_emu_core_begin
+#define bsp_end ebsp_emu_core_end
+#define bsp_nprocs ebsp_emu_core_nprocs
+#define main ebsp_emu_kernel_main
+
+void bsp_begin();
+void bsp_end();
+int bsp_nprocs();
+int bsp_pid();
+float bsp_time();
+void bsp_sync();
+
+void bsp_push_reg(const void* variable, const int nbytes);
+void bsp_hpput(int pid, const void* src, const void* dst, int offset,
+               int nbytes);
+void bsp_hpget(int pid, const void* src, int offset, void* dst, int nbytes);
+
+void bsp_qsize(int* packets, int* accumulated_bytes);
+void bsp_get_tag(int* status, void* tag);
+void bsp_move(void* payload, int buffer_size);
+
+void ebsp_barrier();
+void ebsp_message(const char* format, ...);
+
+void* ebsp_malloc(unsigned int nbytes);
+void ebsp_free(void* ptr);
+void ebsp_memcpy(void* dst, const void* src, size_t nbytes);
+
+void* ebsp_get_direct_address(int pid, const void* variable);
+
+typedef struct {
+    int busy;
+} ebsp_dma_handle;
+
+void ebsp_dma_push(ebsp_dma_handle* desc, void* dst, const void* src,
+                   size_t nbytes);
+void ebsp_dma_wait(ebsp_dma_handle* desc);
+
+int ebsp_open_down_stream(void** address, unsigned int stream_id);
+int ebsp_open_up_stream(void** address, unsigned int stream_id);
+void ebsp_close_down_stream(unsigned int stream_id);
+void ebsp_close_up_stream(unsigned int stream_id);
+int ebsp_move_chunk_down(void** address, unsigned int stream_id,
+                         int prealloc);
+int ebsp_move_chunk_up(void** address, unsigned int stream_id, int prealloc);
+void ebsp_move_down_cursor(int stream_id, int jump_n_chunks);
+void ebsp_reset_down_cursor(int stream_id);
+void ebsp_set_up_chunk_size(unsigned int stream_id, int nbytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,89 @@
+/*
+File: emulator/include/host_bsp.h
+
+This file is part of the Zephany; linear algebra library for the Epiphany
+
+Copyright (C) 2015 Jan-Willem Buurlage <janwillembuurlage@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License (LGPL)
+as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+*/
+
+/* Native stand-in for the host side of Epiphany BSP.
+ *
+ * Only the subset of host_bsp that Zephany uses is provided. Kernels are
+ * loaded from shared objects instead of srec files: bsp_init("kernels/x.srec")
+ * loads "kernels/x.so" relative to the directory of the running executable,
+ * and ebsp_spmd() runs it on one thread per simulated core. */
+
+#pragma once
+
+#include <stddef.h>
+
+#define EBSP_EMULATOR 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int bsp_init(const char* e_name, int argc, char** argv);
+int bsp_begin(int nprocs);
+int ebsp_spmd();
+int bsp_end();
+int bsp_nprocs();
+
+void ebsp_set_tagsize(int* tag_bytes);
+int ebsp_get_tagsize();
+void ebsp_send_down(int pid, const void* tag, const void* payload, int nbytes);
+
+/* Create a stream of fixed size chunks. The data is copied into external
+ * memory, the returned pointer refers to that copy. The streams stay alive
+ * until bsp_end(), writing through the pointer between two calls to
+ * ebsp_spmd() changes what the next program receives. Messages sent down are
+ * only delivered to the next program. */
+void* ebsp_create_down_stream(const void* src, int pid, int total_size,
+                              int chunk_size);
+
+/* Create a stream of variable size chunks. Every chunk in `src` is preceded
+ * by its size in bytes as an `int`. If `total_size` is zero the stream is
+ * scanned until a chunk of size zero is encountered; if `max_chunk_size` is
+ * zero it is computed from the chunk headers. */
+void* ebsp_create_down_stream_raw(const void* src, int pid, int total_size,
+                                  int max_chunk_size);
+
+/* Create an (initially zeroed) stream that is filled by the kernel, the
+ * returned pointer can be read after ebsp_spmd() until bsp_end(). */
+void* ebsp_create_up_stream(int pid, int total_size, int chunk_size);
+
+/* Emulator only: statistics gathered during the last call to ebsp_spmd(),
+ * summed over all cores. Useful for comparing stream layouts. */
+typedef struct {
+    unsigned long long chunks_down;
+    unsigned long long bytes_down;
+    /* chunks moved down by double buffered moves ahead of the move that
+     * returns them, these are included in chunks_down */
+    unsigned long long chunks_prefetched;
+    unsigned long long chunks_up;
+    unsigned long long bytes_up;
+    unsigned long long cursor_moves;
+    unsigned long long syncs;
+    unsigned long long barriers;
+    unsigned long long hpgets;
+    unsigned long long hpget_bytes;
+    unsigned long long hpputs;
+    unsigned long long hpput_bytes;
+    unsigned long long dma_transfers;
+    unsigned long long dma_bytes;
+    /* maximum over the cores instead of the sum */
+    unsigned long long peak_local_bytes;
+    double spmd_seconds;
+} ebsp_emu_statistics;
+
+ebsp_emu_statistics ebsp_emu_get_statistics();
+void ebsp_emu_print_statistics();
+
+#ifdef __cplusplus
+}
+#endif
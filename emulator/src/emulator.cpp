@@ -0,0 +1,786 @@
+/*
+File: emulator/src/emulator.cpp
+
+This file is part of the Zephany; linear algebra library for the Epiphany
+
+Copyright (C) 2015 Jan-Willem Buurlage <janwillembuurlage@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License (LGPL)
+as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+*/
+
+/* pthread backed emulator for the subset of Epiphany BSP used by Zephany.
+ *
+ * - every core is a thread, running the kernel loaded by bsp_init
+ * - local memory is accounted per core (stream buffers and ebsp_malloc),
+ *   the budget defaults to 32 KB and can be set with EBSP_EMU_LOCAL_MEMORY
+ * - external memory is ordinary host memory owned by the emulator
+ * - DMA transfers and hp-communication are performed immediately
+ * - a double buffered move of a down stream prefetches the next chunk into
+ *   the other buffer at once, and the next move returns this chunk even if
+ *   the cursor was moved in between, as on the device */
+
+// The core functions have to be declared under their emulated names, so we
+// include the core header first and drop its renames.
+#include "../include/e_bsp.h"
+#undef bsp_begin
+#undef bsp_end
+#undef bsp_nprocs
+#undef main
+#include "../include/host_bsp.h"
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int max_processors = 16;
+constexpr size_t default_local_memory = 32 * 1024;
+
+using kernel_function = int (*)();
+using emu_clock = std::chrono::steady_clock;
+
+class Barrier {
+  public:
+    void reset(int count) {
+        count_ = count;
+        waiting_ = 0;
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto generation = generation_;
+        if (++waiting_ == count_) {
+            waiting_ = 0;
+            ++generation_;
+            condition_.notify_all();
+        } else {
+            condition_.wait(lock,
+                            [&] { return generation != generation_; });
+        }
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    int count_ = 0;
+    int waiting_ = 0;
+    unsigned long long generation_ = 0;
+};
+
+struct Message {
+    std::vector<char> tag;
+    std::vector<char> payload;
+};
+
+struct EmuStream {
+    bool down = true;
+
+    // external memory, for down streams only the chunk payloads are stored
+    std::vector<char> data;
+    std::vector<size_t> chunkOffsets;
+    std::vector<int> chunkSizes;
+    int maxChunkSize = 0;
+
+    // down: index of next chunk, up: byte offset of next chunk
+    size_t cursor = 0;
+    // down: the chunk in the other buffer that was prefetched by the last
+    // move, if any
+    bool prefetched = false;
+    size_t prefetchedChunk = 0;
+    int upChunkSize = 0;
+
+    // local buffers
+    bool open = false;
+    char* buffers[2] = {nullptr, nullptr};
+    int current = 0;
+};
+
+struct Core {
+    int pid = 0;
+
+    std::vector<std::unique_ptr<EmuStream>> streams;
+    std::vector<Message> inbox;
+    size_t nextMessage = 0;
+    std::vector<const void*> registrations;
+    std::mutex registrationMutex;
+
+    std::map<void*, size_t> allocations;
+    size_t localBytes = 0;
+
+    ebsp_emu_statistics stats = {};
+};
+
+struct Emulator {
+    std::string kernelPath;
+    void* kernelHandle = nullptr;
+    kernel_function kernel = nullptr;
+
+    int nprocs = 0;
+    int tagsize = 0;
+    size_t localMemory = default_local_memory;
+
+    std::vector<std::unique_ptr<Core>> cores;
+    Barrier barrier;
+    std::mutex outputMutex;
+    emu_clock::time_point start;
+
+    ebsp_emu_statistics lastStats = {};
+};
+
+Emulator emu;
+thread_local Core* current_core = nullptr;
+
+Core& core() {
+    if (!current_core) {
+        fprintf(stderr, "ebsp emulator: core function called from host\n");
+        abort();
+    }
+    return *current_core;
+}
+
+void core_error(const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    std::lock_guard<std::mutex> lock(emu.outputMutex);
+    fprintf(stderr, "$%02d: ERROR: %s\n", current_core ? current_core->pid : -1,
+            buffer);
+}
+
+std::string resolve_kernel_path(const char* e_name) {
+    std::string path(e_name);
+
+    const std::string srec = ".srec";
+    if (path.size() >= srec.size() &&
+        path.compare(path.size() - srec.size(), srec.size(), srec) == 0) {
+        path.replace(path.size() - srec.size(), srec.size(), ".so");
+    }
+
+    // relative paths are taken relative to the executable, like the e-loader
+    if (!path.empty() && path[0] != '/') {
+        char exe[4096];
+        auto length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (length > 0) {
+            exe[length] = '\0';
+            std::string dir(exe);
+            dir = dir.substr(0, dir.find_last_of('/') + 1);
+            path = dir + path;
+        }
+    }
+
+    return path;
+}
+
+void* local_alloc(Core& c, size_t nbytes) {
+    if (c.localBytes + nbytes > emu.localMemory) {
+        core_error("out of local memory: requested %zu bytes, %zu of %zu in "
+                   "use",
+                   nbytes, c.localBytes, emu.localMemory);
+        return nullptr;
+    }
+    void* ptr = calloc(std::max(nbytes, (size_t)1), 1);
+    c.allocations[ptr] = nbytes;
+    c.localBytes += nbytes;
+    c.stats.peak_local_bytes =
+        std::max(c.stats.peak_local_bytes, (unsigned long long)c.localBytes);
+    return ptr;
+}
+
+void local_free(Core& c, void* ptr) {
+    auto it = c.allocations.find(ptr);
+    if (it == c.allocations.end())
+        return;
+    c.localBytes -= it->second;
+    c.allocations.erase(it);
+    free(ptr);
+}
+
+EmuStream* get_stream(Core& c, unsigned int stream_id, bool down) {
+    if (stream_id >= c.streams.size() || c.streams[stream_id]->down != down) {
+        core_error("there is no %s stream with id %u", down ? "down" : "up",
+                   stream_id);
+        return nullptr;
+    }
+    return c.streams[stream_id].get();
+}
+
+void close_stream(Core& c, EmuStream& stream) {
+    for (auto& buffer : stream.buffers) {
+        local_free(c, buffer);
+        buffer = nullptr;
+    }
+    stream.open = false;
+    stream.prefetched = false;
+}
+
+// Copy the chunk at the cursor of a down stream into `buffer`
+int move_down(Core& c, EmuStream& stream, char* buffer) {
+    int size = stream.chunkSizes[stream.cursor];
+    memcpy(buffer, stream.data.data() + stream.chunkOffsets[stream.cursor],
+           size);
+    stream.cursor++;
+
+    c.stats.chunks_down++;
+    c.stats.bytes_down += size;
+    return size;
+}
+
+int register_index(const Core& c, const void* variable) {
+    for (int i = (int)c.registrations.size() - 1; i >= 0; --i)
+        if (c.registrations[i] == variable)
+            return i;
+    return -1;
+}
+
+char* remote_address(int pid, const void* variable) {
+    auto& c = core();
+    int idx = register_index(c, variable);
+    if (idx < 0 || pid < 0 || pid >= emu.nprocs) {
+        core_error("variable %p is not registered", variable);
+        return nullptr;
+    }
+
+    auto& remote = *emu.cores[pid];
+    std::lock_guard<std::mutex> lock(remote.registrationMutex);
+    if (idx >= (int)remote.registrations.size()) {
+        core_error("variable %p is not registered on %d", variable, pid);
+        return nullptr;
+    }
+    return (char*)remote.registrations[idx];
+}
+
+Core* host_core(int pid) {
+    if (pid < 0 || pid >= (int)emu.cores.size()) {
+        fprintf(stderr, "ebsp emulator: invalid processor id %d\n", pid);
+        return nullptr;
+    }
+    return emu.cores[pid].get();
+}
+
+void accumulate(ebsp_emu_statistics& total, const ebsp_emu_statistics& s) {
+    total.chunks_down += s.chunks_down;
+    total.bytes_down += s.bytes_down;
+    total.chunks_prefetched += s.chunks_prefetched;
+    total.chunks_up += s.chunks_up;
+    total.bytes_up += s.bytes_up;
+    total.cursor_moves += s.cursor_moves;
+    total.syncs += s.syncs;
+    total.barriers += s.barriers;
+    total.hpgets += s.hpgets;
+    total.hpget_bytes += s.hpget_bytes;
+    total.hpputs += s.hpputs;
+    total.hpput_bytes += s.hpput_bytes;
+    total.dma_transfers += s.dma_transfers;
+    total.dma_bytes += s.dma_bytes;
+    total.peak_local_bytes =
+        std::max(total.peak_local_bytes, s.peak_local_bytes);
+}
+
+} // namespace
+
+/*** HOST ***/
+
+extern "C" {
+
+int bsp_init(const char* e_name, int, char**) {
+    if (emu.kernelHandle)
+        dlclose(emu.kernelHandle);
+
+    emu.kernelPath = resolve_kernel_path(e_name);
+    emu.kernelHandle = dlopen(emu.kernelPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!emu.kernelHandle) {
+        fprintf(stderr, "ebsp emulator: could not load kernel: %s\n",
+                dlerror());
+        return 0;
+    }
+
+    emu.kernel =
+        (kernel_function)dlsym(emu.kernelHandle, "ebsp_emu_kernel_main");
+    if (!emu.kernel) {
+        fprintf(stderr, "ebsp emulator: %s has no kernel entry point\n",
+                emu.kernelPath.c_str());
+        return 0;
+    }
+
+    if (const char* memory = getenv("EBSP_EMU_LOCAL_MEMORY"))
+        emu.localMemory = strtoul(memory, nullptr, 10);
+
+    return 1;
+}
+
+int bsp_nprocs() { return max_processors; }
+
+int bsp_begin(int nprocs) {
+    if (nprocs < 1 || nprocs > max_processors) {
+        fprintf(stderr, "ebsp emulator: cannot start %d processors\n",
+                nprocs);
+        return 0;
+    }
+
+    emu.nprocs = nprocs;
+    emu.tagsize = 0;
+    emu.cores.clear();
+    for (int s = 0; s < nprocs; ++s) {
+        emu.cores.emplace_back(new Core());
+        emu.cores.back()->pid = s;
+    }
+
+    return 1;
+}
+
+void ebsp_set_tagsize(int* tag_bytes) {
+    int old = emu.tagsize;
+    emu.tagsize = *tag_bytes;
+    *tag_bytes = old;
+}
+
+int ebsp_get_tagsize() { return emu.tagsize; }
+
+void ebsp_send_down(int pid, const void* tag, const void* payload,
+                    int nbytes) {
+    auto c = host_core(pid);
+    if (!c)
+        return;
+
+    Message message;
+    message.tag.assign((const char*)tag, (const char*)tag + emu.tagsize);
+    message.payload.assign((const char*)payload,
+                           (const char*)payload + nbytes);
+    c->inbox.push_back(std::move(message));
+}
+
+void* ebsp_create_down_stream(const void* src, int pid, int total_size,
+                              int chunk_size) {
+    auto c = host_core(pid);
+    if (!c || chunk_size <= 0 || total_size < 0)
+        return nullptr;
+
+    std::unique_ptr<EmuStream> stream(new EmuStream());
+    stream->data.assign((const char*)src, (const char*)src + total_size);
+    stream->maxChunkSize = chunk_size;
+    for (int offset = 0; offset < total_size; offset += chunk_size) {
+        stream->chunkOffsets.push_back(offset);
+        stream->chunkSizes.push_back(std::min(chunk_size, total_size - offset));
+    }
+
+    void* result = stream->data.data();
+    c->streams.push_back(std::move(stream));
+    return result;
+}
+
+void* ebsp_create_down_stream_raw(const void* src, int pid, int total_size,
+                                  int max_chunk_size) {
+    auto c = host_core(pid);
+    if (!c || total_size < 0)
+        return nullptr;
+
+    std::unique_ptr<EmuStream> stream(new EmuStream());
+
+    const char* data = (const char*)src;
+    size_t offset = 0;
+    int maxChunkSize = 0;
+    std::vector<std::pair<size_t, int>> chunks;
+    while (total_size == 0 || offset < (size_t)total_size) {
+        int size = 0;
+        memcpy(&size, data + offset, sizeof(int));
+        offset += sizeof(int);
+        if (size <= 0)
+            break;
+        chunks.emplace_back(offset, size);
+        maxChunkSize = std::max(maxChunkSize, size);
+        offset += size;
+    }
+
+    if (max_chunk_size != 0 && maxChunkSize > max_chunk_size) {
+        fprintf(stderr, "ebsp emulator: chunk of %d bytes exceeds maximum "
+                        "chunk size of %d bytes\n",
+                maxChunkSize, max_chunk_size);
+        return nullptr;
+    }
+
+    stream->data.assign(data, data + offset);
+    stream->maxChunkSize = max_chunk_size != 0 ? max_chunk_size : maxChunkSize;
+    for (auto& chunk : chunks) {
+        stream->chunkOffsets.push_back(chunk.first);
+        stream->chunkSizes.push_back(chunk.second);
+    }
+
+    void* result = stream->data.data();
+    c->streams.push_back(std::move(stream));
+    return result;
+}
+
+void* ebsp_create_up_stream(int pid, int total_size, int chunk_size) {
+    auto c = host_core(pid);
+    if (!c || chunk_size <= 0 || total_size <= 0)
+        return nullptr;
+
+    std::unique_ptr<EmuStream> stream(new EmuStream());
+    stream->down = false;
+    stream->data.resize(total_size, 0);
+    stream->maxChunkSize = chunk_size;
+    stream->upChunkSize = chunk_size;
+
+    void* result = stream->data.data();
+    c->streams.push_back(std::move(stream));
+    return result;
+}
+
+int ebsp_spmd() {
+    if (!emu.kernel || emu.cores.empty()) {
+        fprintf(stderr, "ebsp emulator: call bsp_init and bsp_begin before "
+                        "ebsp_spmd\n");
+        return 0;
+    }
+
+    emu.barrier.reset(emu.nprocs);
+    emu.start = emu_clock::now();
+
+    std::vector<std::thread> threads;
+    for (auto& c : emu.cores) {
+        c->stats = {};
+        c->localBytes = 0;
+        c->registrations.clear();
+        for (auto& stream : c->streams) {
+            stream->cursor = 0;
+            stream->upChunkSize = stream->maxChunkSize;
+        }
+
+        Core* target = c.get();
+        threads.emplace_back([target] {
+            current_core = target;
+            emu.kernel();
+
+            // buffers do not survive the program
+            for (auto& stream : target->streams)
+                close_stream(*target, *stream);
+            for (auto& allocation : target->allocations)
+                free(allocation.first);
+            target->allocations.clear();
+            target->localBytes = 0;
+            current_core = nullptr;
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    // messages are only available to the program they were sent to, the
+    // streams stay in external memory for the next call
+    for (auto& c : emu.cores) {
+        c->inbox.clear();
+        c->nextMessage = 0;
+    }
+
+    emu.lastStats = {};
+    for (auto& c : emu.cores)
+        accumulate(emu.lastStats, c->stats);
+    emu.lastStats.spmd_seconds =
+        std::chrono::duration<double>(emu_clock::now() - emu.start).count();
+
+    return 1;
+}
+
+int bsp_end() {
+    emu.cores.clear();
+    emu.nprocs = 0;
+    if (emu.kernelHandle) {
+        dlclose(emu.kernelHandle);
+        emu.kernelHandle = nullptr;
+        emu.kernel = nullptr;
+    }
+    return 1;
+}
+
+ebsp_emu_statistics ebsp_emu_get_statistics() { return emu.lastStats; }
+
+void ebsp_emu_print_statistics() {
+    const auto& s = emu.lastStats;
+    printf("ebsp emulator statistics (%s)\n", emu.kernelPath.c_str());
+    printf("  time:          %.6f s\n", s.spmd_seconds);
+    printf("  chunks down:   %llu (%llu bytes)\n", s.chunks_down,
+           s.bytes_down);
+    printf("  prefetched:    %llu\n", s.chunks_prefetched);
+    printf("  chunks up:     %llu (%llu bytes)\n", s.chunks_up, s.bytes_up);
+    printf("  cursor moves:  %llu\n", s.cursor_moves);
+    printf("  syncs:         %llu\n", s.syncs);
+    printf("  barriers:      %llu\n", s.barriers);
+    printf("  hpget:         %llu (%llu bytes)\n", s.hpgets, s.hpget_bytes);
+    printf("  hpput:         %llu (%llu bytes)\n", s.hpputs, s.hpput_bytes);
+    printf("  dma:           %llu (%llu bytes)\n", s.dma_transfers,
+           s.dma_bytes);
+    printf("  peak local:    %llu bytes\n", s.peak_local_bytes);
+}
+
+/*** CORE ***/
+
+void ebsp_emu_core_begin() {}
+
+void ebsp_emu_core_end() {}
+
+int ebsp_emu_core_nprocs() { return emu.nprocs; }
+
+int bsp_pid() { return core().pid; }
+
+float bsp_time() {
+    return std::chrono::duration<float>(emu_clock::now() - emu.start).count();
+}
+
+void bsp_sync() {
+    core().stats.syncs++;
+    emu.barrier.wait();
+}
+
+void ebsp_barrier() {
+    core().stats.barriers++;
+    emu.barrier.wait();
+}
+
+void bsp_push_reg(const void* variable, const int) {
+    auto& c = core();
+    std::lock_guard<std::mutex> lock(c.registrationMutex);
+    c.registrations.push_back(variable);
+}
+
+void bsp_hpput(int pid, const void* src, const void* dst, int offset,
+               int nbytes) {
+    auto target = remote_address(pid, dst);
+    if (!target)
+        return;
+    memcpy(target + offset, src, nbytes);
+    core().stats.hpputs++;
+    core().stats.hpput_bytes += nbytes;
+}
+
+void bsp_hpget(int pid, const void* src, int offset, void* dst, int nbytes) {
+    auto source = remote_address(pid, src);
+    if (!source)
+        return;
+    memcpy(dst, source + offset, nbytes);
+    core().stats.hpgets++;
+    core().stats.hpget_bytes += nbytes;
+}
+
+void bsp_qsize(int* packets, int* accumulated_bytes) {
+    auto& c = core();
+    *packets = 0;
+    *accumulated_bytes = 0;
+    for (size_t i = c.nextMessage; i < c.inbox.size(); ++i) {
+        (*packets)++;
+        *accumulated_bytes += (int)c.inbox[i].payload.size();
+    }
+}
+
+void bsp_get_tag(int* status, void* tag) {
+    auto& c = core();
+    if (c.nextMessage >= c.inbox.size()) {
+        *status = -1;
+        return;
+    }
+    auto& message = c.inbox[c.nextMessage];
+    *status = (int)message.payload.size();
+    memcpy(tag, message.tag.data(), message.tag.size());
+}
+
+void bsp_move(void* payload, int buffer_size) {
+    auto& c = core();
+    if (c.nextMessage >= c.inbox.size())
+        return;
+    auto& message = c.inbox[c.nextMessage++];
+    memcpy(payload, message.payload.data(),
+           std::min((size_t)buffer_size, message.payload.size()));
+}
+
+void ebsp_message(const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    std::lock_guard<std::mutex> lock(emu.outputMutex);
+    printf("$%02d: %s\n", core().pid, buffer);
+}
+
+void* ebsp_malloc(unsigned int nbytes) { return local_alloc(core(), nbytes); }
+
+void ebsp_free(void* ptr) { local_free(core(), ptr); }
+
+void ebsp_memcpy(void* dst, const void* src, size_t nbytes) {
+    memcpy(dst, src, nbytes);
+}
+
+void* ebsp_get_direct_address(int pid, const void* variable) {
+    return remote_address(pid, variable);
+}
+
+void ebsp_dma_push(ebsp_dma_handle* desc, void* dst, const void* src,
+                   size_t nbytes) {
+    memcpy(dst, src, nbytes);
+    desc->busy = 0;
+    core().stats.dma_transfers++;
+    core().stats.dma_bytes += nbytes;
+}
+
+void ebsp_dma_wait(ebsp_dma_handle*) {}
+
+int ebsp_open_down_stream(void** address, unsigned int stream_id) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, true);
+    if (!stream)
+        return 0;
+    if (!stream->open) {
+        stream->buffers[0] = (char*)local_alloc(c, stream->maxChunkSize);
+        stream->current = 0;
+        stream->open = true;
+    }
+    *address = stream->buffers[0];
+    return stream->maxChunkSize;
+}
+
+int ebsp_open_up_stream(void** address, unsigned int stream_id) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, false);
+    if (!stream)
+        return 0;
+    if (!stream->open) {
+        stream->buffers[0] = (char*)local_alloc(c, stream->maxChunkSize);
+        stream->current = 0;
+        stream->open = true;
+    }
+    *address = stream->buffers[0];
+    return stream->maxChunkSize;
+}
+
+void ebsp_close_down_stream(unsigned int stream_id) {
+    auto& c = core();
+    if (auto stream = get_stream(c, stream_id, true))
+        close_stream(c, *stream);
+}
+
+void ebsp_close_up_stream(unsigned int stream_id) {
+    auto& c = core();
+    if (auto stream = get_stream(c, stream_id, false))
+        close_stream(c, *stream);
+}
+
+int ebsp_move_chunk_down(void** address, unsigned int stream_id,
+                         int prealloc) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, true);
+    if (!stream || !stream->open)
+        return 0;
+
+    // the other buffer is only allocated by the first double buffered move
+    if (prealloc && !stream->buffers[1]) {
+        stream->buffers[1] = (char*)local_alloc(c, stream->maxChunkSize);
+        if (!stream->buffers[1])
+            return 0;
+    }
+
+    int size = 0;
+    if (stream->prefetched) {
+        // the chunk has been moved into the other buffer by the last move,
+        // moving the cursor since then only affects the chunks after it
+        stream->current = 1 - stream->current;
+        size = stream->chunkSizes[stream->prefetchedChunk];
+        stream->prefetched = false;
+    } else {
+        if (stream->cursor >= stream->chunkOffsets.size())
+            return 0;
+        stream->current = prealloc ? 1 - stream->current : 0;
+        size = move_down(c, *stream, stream->buffers[stream->current]);
+    }
+    *address = stream->buffers[stream->current];
+
+    // in double buffered mode the next chunk is moved into the other buffer
+    // while the current one is used
+    if (prealloc && stream->cursor < stream->chunkOffsets.size()) {
+        stream->prefetchedChunk = stream->cursor;
+        move_down(c, *stream, stream->buffers[1 - stream->current]);
+        stream->prefetched = true;
+        c.stats.chunks_prefetched++;
+    }
+    return size;
+}
+
+int ebsp_move_chunk_up(void** address, unsigned int stream_id, int prealloc) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, false);
+    if (!stream || !stream->open)
+        return 0;
+
+    int size = stream->upChunkSize;
+    if (stream->cursor + size > stream->data.size()) {
+        core_error("up stream %u is full", stream_id);
+        return 0;
+    }
+    memcpy(stream->data.data() + stream->cursor, *address, size);
+    stream->cursor += size;
+
+    if (prealloc) {
+        if (!stream->buffers[1])
+            stream->buffers[1] = (char*)local_alloc(c, stream->maxChunkSize);
+        stream->current = 1 - stream->current;
+        *address = stream->buffers[stream->current];
+    }
+
+    c.stats.chunks_up++;
+    c.stats.bytes_up += size;
+    return size;
+}
+
+void ebsp_move_down_cursor(int stream_id, int jump_n_chunks) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, true);
+    if (!stream)
+        return;
+    long long cursor = (long long)stream->cursor + jump_n_chunks;
+    cursor = std::max(0ll, std::min(cursor,
+                                    (long long)stream->chunkOffsets.size()));
+    stream->cursor = (size_t)cursor;
+    c.stats.cursor_moves++;
+}
+
+void ebsp_reset_down_cursor(int stream_id) {
+    auto& c = core();
+    if (auto stream = get_stream(c, stream_id, true)) {
+        stream->cursor = 0;
+        c.stats.cursor_moves++;
+    }
+}
+
+void ebsp_set_up_chunk_size(unsigned int stream_id, int nbytes) {
+    auto& c = core();
+    auto stream = get_stream(c, stream_id, false);
+    if (!stream)
+        return;
+    if (nbytes > stream->maxChunkSize) {
+        core_error("up chunk of %d bytes exceeds buffer of %d bytes", nbytes,
+                   stream->maxChunkSize);
+        return;
+    }
+    stream->upChunkSize = nbytes;
+}
+
+} // extern "C"
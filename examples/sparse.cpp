@@ -31,8 +31,11 @@ int main() {
     TVectorPartitioner vectorPartitioner(S, x, y);
     vectorPartitioner.partition();
 
-    // create a strip / window "view"
-    SparseStream<decltype(S), decltype(x)> sparseStream(S, x, 50, 50);
+    // create a strip / window "view", with sizes that fit in local memory
+    SparseStreamTuner<decltype(S), decltype(x)> tuner(S, x);
+    auto sizes = tuner.tune();
+    SparseStream<decltype(S), decltype(x)> sparseStream(
+        S, x, sizes.stripSize, sizes.windowSize);
     sparseStream.prepareStream();
 
     y = S * x;
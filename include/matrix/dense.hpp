@@ -25,12 +25,16 @@ class DStreamingMatrix
         : DStreamingMatrix(ZEPHANY_DEFAULT_INNER_SIZE, size) {}
 
     DStreamingMatrix(TIdx innerBlockSize, TIdx size)
-        : Base(size, size), stream_(stream_direction::down),
+        : DStreamingMatrix(innerBlockSize, size, size) {}
+
+    /* An m x n matrix. The outer blocks at the edges are padded with zeros
+     * in the stream, so the sizes need not be multiples of the outer block
+     * size. */
+    DStreamingMatrix(TIdx innerBlockSize, TIdx rows, TIdx cols)
+        : Base(rows, cols), stream_(stream_direction::down),
           innerBlockSize_(innerBlockSize) {
-          ZeeAssertMsg(size >= innerBlockSize_ * innerBlocks_,
-                       "Streaming matrices have to be larger than MN x MN, "
-                       "where N is the dimension of the processor mesh and M "
-                       "is the inner block size.");
+        ZeeAssertMsg(rows > 0 && cols > 0,
+                     "Streaming matrices can not be empty");
 
         initializeStream_();
     }
@@ -54,6 +58,9 @@ class DStreamingMatrix
     }
 
     DStreamingMatrix(DStreamingMatrix& other) = default;
+    DStreamingMatrix(DStreamingMatrix&& other) = default;
+    DStreamingMatrix& operator=(const DStreamingMatrix& other) = default;
+    DStreamingMatrix& operator=(DStreamingMatrix&& other) = default;
 
     MatrixBlockStream<TVal, TIdx>& getStream() { return stream_; }
     const MatrixBlockStream<TVal, TIdx>& getStream() const { return stream_; }
@@ -72,6 +79,45 @@ class DStreamingMatrix
         return stream_.element(i, j);
     }
 
+    /* Bulk access to the matrix. These copy complete rows of inner blocks,
+     * and should be preferred over element-wise access using at(). Buffers
+     * are row major, with getRows() x getCols() elements. */
+    void fill(const TVal* data) { stream_.fill(data, this->cols_); }
+
+    void fill(const std::vector<TVal>& data) {
+        ZeeAssert(data.size() == (size_t)this->rows_ * this->cols_);
+        fill(data.data());
+    }
+
+    void fill(const DMatrix<TVal, TIdx>& matrix) {
+        ZeeAssert(matrix.getRows() == this->rows_ &&
+                  matrix.getCols() == this->cols_);
+        generate([&](TIdx i, TIdx j) { return matrix.at(i, j); });
+    }
+
+    /* Set element (i, j) to f(i, j) */
+    template <typename TFunc>
+    void generate(TFunc f) {
+        stream_.generate(f);
+    }
+
+    void extract(TVal* data) const { stream_.extract(data, this->cols_); }
+
+    void extract(std::vector<TVal>& data) const {
+        data.resize((size_t)this->rows_ * this->cols_);
+        extract(data.data());
+    }
+
+    void extract(DMatrix<TVal, TIdx>& matrix) const {
+        ZeeAssert(matrix.getRows() == this->rows_ &&
+                  matrix.getCols() == this->cols_);
+        std::vector<TVal> data;
+        extract(data);
+        for (TIdx i = 0; i < this->rows_; ++i)
+            for (TIdx j = 0; j < this->cols_; ++j)
+                matrix.at(i, j) = data[i * this->cols_ + j];
+    }
+
     void setInnerBlockSize(TIdx innerBlockSize) {
         innerBlockSize_ = innerBlockSize;
         outerBlockSize_ = innerBlocks_ * innerBlockSize;
@@ -82,49 +128,37 @@ class DStreamingMatrix
         matrixFromUpStream_(stream);
     }
 
+    /* Use the buffers of an up stream as the data of this matrix, without
+     * copying. The buffers stay in use until `region` is reclaimed, at which
+     * point the matrix takes a copy. */
+    void adoptUpStream(const UpStream<TVal>& stream, ExternalRegion& region) {
+        ZeeAssert(stream.getTotalSize() ==
+                  stream_.getLayout().elementsPerProcessor() * sizeof(TVal));
+
+        stream_.alias(stream.getRawData(), stream_.getLayout(), region);
+    }
+
   private:
     void initializeStream_() {
-        // FIXME pad zeroes?
-        const TIdx outerBlocks =
-            (this->getRows() - 1) / outerBlockSize_ + 1;
+        const TIdx outerRows = (this->getRows() - 1) / outerBlockSize_ + 1;
+        const TIdx outerCols = (this->getCols() - 1) / outerBlockSize_ + 1;
 
         stream_.setInner(innerBlocks_, innerBlockSize_);
-        stream_.setOuter(outerBlocks, outerBlockSize_);
-        stream_.setMatrixSize(this->getRows());
+        stream_.setOuter(outerRows, outerCols, outerBlockSize_);
+        stream_.setMatrixSize(this->getRows(), this->getCols());
         stream_.computeChunkSize();
         stream_.reshape();
     }
 
     void matrixFromUpStream_(const UpStream<TVal>& stream) {
-        const TIdx outerBlocks =
-            (this->getRows() - 1) / outerBlockSize_ + 1;
+        // The up stream is always laid out left-handed (row major), which is
+        // exactly the layout of our own stream, so we copy whole buffers.
 
         auto data = stream.getRawData();
-
-        // This is always laid out left-handed (row major)
-        for (TIdx blockI = 0; blockI < outerBlocks; ++blockI)
-        for (TIdx blockJ = 0; blockJ < outerBlocks; ++blockJ) {
-            TIdx blockOffsetI = blockI * outerBlockSize_;
-            TIdx blockOffsetJ = blockJ * outerBlockSize_;
-            for (TIdx s = 0; s < stream_config::N; ++s)
-            for (TIdx t = 0; t < stream_config::N; ++t) {
-                TIdx procOffsetI = s * innerBlockSize_;
-                TIdx procOffsetJ = t * innerBlockSize_;
-                for (TIdx i = 0; i < innerBlockSize_; ++i)
-                for (TIdx j = 0; j < innerBlockSize_; ++j) {
-                    // TODO: optimize this for speed.. this is ridiculous
-                    if (blockOffsetI + procOffsetI + i >= this->rows_ ||
-                        blockOffsetJ + procOffsetJ + j >= this->cols_)
-                        break;
-
-                    this->at(blockOffsetI + procOffsetI + i,
-                             blockOffsetJ + procOffsetJ + j) =
-                        data[s * stream_config::N +
-                             t][(blockI * outerBlocks + blockJ) *
-                                    (innerBlockSize_ * innerBlockSize_) +
-                                i * innerBlockSize_ + j];
-                }
-            }
+        const TIdx elements = stream_.getLayout().elementsPerProcessor();
+        ZeeAssert(stream.getTotalSize() == elements * sizeof(TVal));
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            std::copy(data[s], data[s] + elements, stream_.buffer(s));
         }
     }
 
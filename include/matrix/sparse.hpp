@@ -30,15 +30,29 @@ class DStreamingSparseMatrix
     double loadImbalance() const override { return -1.0; }
     TIdx communicationVolume() const override { return 0; }
 
-    // FIXME
-    SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
-                 DStreamingVector<TVal, TIdx>>& getStream() const {
-        return *this->stream_;
-    };
+    using stream_type = SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
+                                     DStreamingVector<TVal, TIdx>>;
+
+    /* The stream that was last prepared for this matrix, which is used for
+     * products with the matrix. */
+    stream_type& getStream() const {
+        ZeeAssertMsg(stream_ != nullptr,
+                     "no sparse stream has been prepared for the matrix");
+        return *stream_;
+    }
+
+    bool hasStream() const { return stream_ != nullptr; }
+
+    void setStream(stream_type* stream) { stream_ = stream; }
+
+    /* Called when `stream` is destroyed. */
+    void releaseStream(const stream_type* stream) {
+        if (stream_ == stream)
+            stream_ = nullptr;
+    }
 
   private:
-    SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
-                 DStreamingVector<TVal, TIdx>>* stream_;
+    stream_type* stream_ = nullptr;
 };
 
 } // namespace zephany
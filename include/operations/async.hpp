@@ -0,0 +1,149 @@
+#pragma once
+
+#include <zee.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "operations.hpp"
+
+namespace Zephany {
+
+/* Runs operations on a dedicated device thread, in the order in which they
+ * are submitted. While an operation runs on the device the calling thread is
+ * free to prepare the operands of the next one.
+ *
+ * The operands of a submitted operation are used by the device thread, so
+ * they have to stay alive and unchanged until its future is ready. The
+ * device session is reserved for the device thread while work is pending,
+ * and operations that other threads perform on the device in the meantime
+ * are rejected. The queue is destroyed before the session, and finishes
+ * the pending operations first. */
+class DeviceQueue {
+  public:
+    static DeviceQueue& instance() {
+        static DeviceQueue queue;
+        return queue;
+    }
+
+    DeviceQueue()
+        : session_(Session::instance()), worker_([this] { work_(); }) {}
+
+    /* The operations that are still pending are run before the worker
+     * stops. */
+    ~DeviceQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        worker_.join();
+    }
+
+    DeviceQueue(const DeviceQueue&) = delete;
+    DeviceQueue& operator=(const DeviceQueue&) = delete;
+
+    template <typename TOperation>
+    auto submit(TOperation op)
+        -> std::future<decltype(perform_operation(op))> {
+        using TResult = decltype(perform_operation(op));
+
+        auto task = std::make_shared<std::packaged_task<TResult()>>(
+            [this, op]() mutable {
+                // the operation is finished before its future is ready, so
+                // that the caller can use the session once it has the result
+                Finish finish{*this};
+                auto result = perform_operation(op);
+                // the result is handed to another thread, so it can not
+                // keep aliasing memory that the next operation reuses
+                detach_(result);
+                return result;
+            });
+        auto future = task->get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace_back([task] { (*task)(); });
+            if (pending_++ == 0)
+                session_.reserve(worker_.get_id());
+        }
+        wake_.notify_all();
+
+        return future;
+    }
+
+    /* Block until every submitted operation has finished. */
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+  private:
+    template <typename TVal, typename TIdx>
+    static void detach_(DStreamingMatrix<TVal, TIdx>& matrix) {
+        matrix.getStream().detach();
+    }
+
+    template <typename TResult>
+    static void detach_(TResult&) {}
+
+    void work_() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty())
+                    return;
+
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    struct Finish {
+        DeviceQueue& queue;
+        ~Finish() { queue.finish_(); }
+    };
+
+    void finish_() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0)
+                session_.release();
+        }
+        done_.notify_all();
+    }
+
+    // the session is created before the queue, so that it is destroyed after
+    // the worker has finished
+    Session& session_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::deque<std::function<void()>> tasks_;
+    std::size_t pending_ = 0;
+    bool stop_ = false;
+
+    // declared last, so that it starts after the other members exist
+    std::thread worker_;
+};
+
+/* Submit an operation, e.g. `auto C = submit(A * B);`, to the device queue.
+ * The result can be obtained with `C.get()`. */
+template <typename TOperation>
+auto submit(TOperation op) -> decltype(DeviceQueue::instance().submit(op)) {
+    return DeviceQueue::instance().submit(op);
+}
+
+} // namespace Zephany
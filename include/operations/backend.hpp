@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+
+namespace Zephany {
+
+/* Where operations on streaming objects are executed. The device backend
+ * streams to the Epiphany, the host backend runs the same algorithm on the
+ * host processor using the stream data directly. The default can be chosen
+ * by setting ZEPHANY_BACKEND to 'device' or 'host'. */
+enum class execution_backend { device, host };
+
+namespace detail {
+
+inline execution_backend& currentBackend() {
+    static execution_backend backend = [] {
+        const char* name = std::getenv("ZEPHANY_BACKEND");
+        if (name && std::strcmp(name, "host") == 0)
+            return execution_backend::host;
+        return execution_backend::device;
+    }();
+    return backend;
+}
+
+} // namespace detail
+
+inline void setBackend(execution_backend backend) {
+    detail::currentBackend() = backend;
+}
+
+inline execution_backend getBackend() { return detail::currentBackend(); }
+
+namespace detail {
+
+inline bool& currentVerification() {
+    static bool verification = [] {
+        const char* value = std::getenv("ZEPHANY_VERIFY");
+        return value && std::strcmp(value, "1") == 0;
+    }();
+    return verification;
+}
+
+} // namespace detail
+
+/* In verification mode the result of a product on the device is compared
+ * to the same product computed on the host, and a mismatch is an error.
+ * It can also be enabled by setting ZEPHANY_VERIFY to 1. */
+inline void setVerification(bool verify) {
+    detail::currentVerification() = verify;
+}
+
+inline bool getVerification() { return detail::currentVerification(); }
+
+} // namespace Zephany
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+
+#include "../streams/config.hpp"
+
+namespace Zephany {
+
+/* The order in which Cannon's algorithm moves through the outer blocks of
+ * C = A B, for A with M_r x M_k outer blocks and B with M_k x M_c.
+ *
+ * outer_blocks: one outer block C_IJ is resident, and A_IK and B_KJ are
+ * streamed down for every K, so every outer block of A is moved down M_c
+ * times and every outer block of B M_r times.
+ *
+ * tiles: a tile of g_r x g_c outer blocks of C is resident, and for every K
+ * a panel of g_r outer blocks of A and one of g_c outer blocks of B are
+ * streamed down, so every outer block of A is moved down M_c / g_c times
+ * and every outer block of B M_r / g_r times. The tile is the one that
+ * moves the fewest bytes among those that fit in the local memory budget,
+ * with g_r = g_c = 1 this is the outer_blocks schedule. When the tile does
+ * not divide the outer blocks of C, the operands are padded with zero
+ * blocks in the stream, as long as this adds at most a quarter to the
+ * outer blocks of C that are computed. */
+enum class cannon_schedule { outer_blocks, tiles };
+
+namespace detail {
+
+inline cannon_schedule& currentCannonSchedule() {
+    static cannon_schedule schedule = cannon_schedule::tiles;
+    return schedule;
+}
+
+// the local memory that the Cannon tiles may use
+constexpr std::size_t cannon_tile_memory = stream_config::buffer_memory;
+
+} // namespace detail
+
+inline void setCannonSchedule(cannon_schedule schedule) {
+    detail::currentCannonSchedule() = schedule;
+}
+
+inline cannon_schedule getCannonSchedule() {
+    return detail::currentCannonSchedule();
+}
+
+/* How a product of streamed matrices is run by k_cannon, and the bytes that
+ * it moves between external memory and the cores, summed over the cores. */
+struct CannonPlan {
+    cannon_schedule schedule = cannon_schedule::outer_blocks;
+    // the number of outer blocks along the rows and the columns of the
+    // resident tile of C
+    std::size_t tileRows = 1;
+    std::size_t tileCols = 1;
+    // the outer blocks of C that are computed, padded to whole tiles
+    std::size_t paddedRows = 0;
+    std::size_t paddedCols = 0;
+    // the local memory of k_cannon on every core
+    std::size_t localMemory = 0;
+    std::size_t bytesDown = 0;
+    std::size_t bytesUp = 0;
+};
+
+/* The plan of a product with the given schedule, for A with M_r x M_k and B
+ * with M_k x M_c outer blocks of N x N inner blocks of `innerBlockSize`
+ * elements. */
+template <typename TVal>
+CannonPlan planCannon(std::size_t innerBlockSize, std::size_t outerRows,
+                      std::size_t outerInner, std::size_t outerCols,
+                      cannon_schedule schedule) {
+    const std::size_t blockBytes =
+        innerBlockSize * innerBlockSize * sizeof(TVal);
+    const std::size_t processors = stream_config::processors;
+
+    // a panel of A and of B, in double buffered streams and a shift
+    // buffer, and a double buffered tile of C
+    auto localMemory = [&](std::size_t rows, std::size_t cols) {
+        return (3 * rows + 3 * cols + 2 * rows * cols) * blockBytes;
+    };
+    auto tiles = [](std::size_t blocks, std::size_t size) {
+        return (blocks + size - 1) / size;
+    };
+    auto bytesDown = [&](std::size_t rows, std::size_t cols) {
+        const std::size_t steps =
+            tiles(outerRows, rows) * tiles(outerCols, cols) * outerInner;
+        return processors * steps * (rows + cols) * blockBytes;
+    };
+    auto padded = [&](std::size_t rows, std::size_t cols) {
+        return tiles(outerRows, rows) * rows * tiles(outerCols, cols) * cols;
+    };
+
+    CannonPlan plan;
+    plan.schedule = schedule;
+    if (schedule == cannon_schedule::tiles) {
+        for (std::size_t rows = 1; rows <= outerRows; ++rows) {
+            for (std::size_t cols = 1; cols <= outerCols; ++cols) {
+                if (4 * padded(rows, cols) > 5 * outerRows * outerCols ||
+                    localMemory(rows, cols) > detail::cannon_tile_memory)
+                    continue;
+                // on equal volume the larger tile takes fewer steps
+                auto best = bytesDown(plan.tileRows, plan.tileCols);
+                if (bytesDown(rows, cols) < best ||
+                    (bytesDown(rows, cols) == best &&
+                     rows * cols > plan.tileRows * plan.tileCols)) {
+                    plan.tileRows = rows;
+                    plan.tileCols = cols;
+                }
+            }
+        }
+    }
+
+    plan.paddedRows = tiles(outerRows, plan.tileRows) * plan.tileRows;
+    plan.paddedCols = tiles(outerCols, plan.tileCols) * plan.tileCols;
+    plan.localMemory = localMemory(plan.tileRows, plan.tileCols);
+    plan.bytesDown = bytesDown(plan.tileRows, plan.tileCols);
+    plan.bytesUp = processors * plan.paddedRows * plan.paddedCols * blockBytes;
+    return plan;
+}
+
+/* The plan of a product of matrices with M x M outer blocks. */
+template <typename TVal>
+CannonPlan planCannon(std::size_t innerBlockSize, std::size_t outerBlocks,
+                      cannon_schedule schedule) {
+    return planCannon<TVal>(innerBlockSize, outerBlocks, outerBlocks,
+                            outerBlocks, schedule);
+}
+
+} // namespace Zephany
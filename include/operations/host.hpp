@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "../streams/matrix_block.hpp"
+#include "../util/thread_pool.hpp"
+
+namespace Zephany {
+
+namespace host {
+
+/* C += A * B for row major inner blocks of size x size. Four rows of C are
+ * kept in flight so that every loaded element of B is used four times, and
+ * the inner loop over j is contiguous so that it can be vectorized. */
+template <typename TVal, typename TIdx>
+void multiplyAddBlock(const TVal* __restrict__ A, const TVal* __restrict__ B,
+                      TVal* __restrict__ C, TIdx size) {
+    TIdx i = 0;
+    for (; i + 4 <= size; i += 4) {
+        TVal* __restrict__ c0 = C + i * size;
+        TVal* __restrict__ c1 = c0 + size;
+        TVal* __restrict__ c2 = c1 + size;
+        TVal* __restrict__ c3 = c2 + size;
+        for (TIdx k = 0; k < size; ++k) {
+            const TVal a0 = A[i * size + k];
+            const TVal a1 = A[(i + 1) * size + k];
+            const TVal a2 = A[(i + 2) * size + k];
+            const TVal a3 = A[(i + 3) * size + k];
+            const TVal* __restrict__ b = B + k * size;
+            for (TIdx j = 0; j < size; ++j) {
+                c0[j] += a0 * b[j];
+                c1[j] += a1 * b[j];
+                c2[j] += a2 * b[j];
+                c3[j] += a3 * b[j];
+            }
+        }
+    }
+
+    for (; i < size; ++i) {
+        TVal* __restrict__ c = C + i * size;
+        for (TIdx k = 0; k < size; ++k) {
+            const TVal a = A[i * size + k];
+            const TVal* __restrict__ b = B + k * size;
+            for (TIdx j = 0; j < size; ++j)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+/* Cannon's algorithm on the host. Every (processor, outer block of C) pair is
+ * a task, and like on the device processor (s, t) visits the inner blocks
+ * k = s + t, s + t + 1, ... (mod N), so that concurrent tasks work on
+ * different blocks of A and B. */
+template <typename TVal, typename TIdx>
+void cannon(const MatrixBlockStream<TVal, TIdx>& lhs,
+            const MatrixBlockStream<TVal, TIdx>& rhs,
+            MatrixBlockStream<TVal, TIdx>& result) {
+    const TIdx N = stream_config::N;
+    const TIdx innerBlockSize = lhs.getInnerBlockSize();
+    const TIdx outerRows = lhs.getOuterRows();
+    const TIdx outerInner = lhs.getOuterCols();
+    const TIdx outerCols = rhs.getOuterCols();
+    const TIdx chunkElements = innerBlockSize * innerBlockSize;
+
+    ZeeAssert(rhs.getInnerBlockSize() == innerBlockSize);
+    ZeeAssert(rhs.getOuterRows() == outerInner);
+    ZeeAssert(result.getOuterRows() == outerRows &&
+              result.getOuterCols() == outerCols);
+
+    // the buffers of the result are detached once, the tasks only write
+    // into them
+    auto& data = result.getData();
+
+    TIdx tasks = stream_config::processors * outerRows * outerCols;
+    hostThreadPool().parallelFor(tasks, [&](TIdx task) {
+        TIdx s = task % stream_config::processors;
+        TIdx outer = task / stream_config::processors;
+        TIdx I = outer / outerCols;
+        TIdx J = outer % outerCols;
+        TIdx si = s / N;
+        TIdx sj = s % N;
+
+        TVal* C = data[s].data() + outer * chunkElements;
+        std::fill(C, C + chunkElements, (TVal)0);
+
+        for (TIdx K = 0; K < outerInner; ++K) {
+            TIdx lhsChunk = I * outerInner + K;
+            TIdx rhsChunk = K * outerCols + J;
+            for (TIdx r = 0; r < N; ++r) {
+                TIdx k = (si + sj + r) % N;
+                const TVal* A =
+                    lhs.buffer(si * N + k) + lhsChunk * chunkElements;
+                const TVal* B =
+                    rhs.buffer(k * N + sj) + rhsChunk * chunkElements;
+                multiplyAddBlock(A, B, C, innerBlockSize);
+            }
+        }
+    });
+}
+
+/* u = A v, computed directly from the nonzeros in the images of A. */
+template <typename TMatrix, typename TVector>
+void spmv(const TMatrix& A, const TVector& v, TVector& u) {
+    using TVal = typename TMatrix::value_type;
+    std::vector<TVal> result(A.getRows(), (TVal)0);
+    for (const auto& image : A.getImages())
+        for (const auto& triplet : *image)
+            result[triplet.row()] += triplet.value() * v[triplet.col()];
+
+    for (std::size_t i = 0; i < result.size(); ++i)
+        u.at(i) = result[i];
+}
+
+namespace detail {
+
+/* The chunks of a raw stream, every chunk is preceded by its size. */
+inline std::vector<const char*> rawChunks(const char* data,
+                                          std::size_t size) {
+    std::vector<const char*> chunks;
+    std::size_t offset = 0;
+    while (offset < size) {
+        int chunkSize = 0;
+        std::memcpy(&chunkSize, data + offset, sizeof(int));
+        chunks.push_back(data + offset + sizeof(int));
+        offset += sizeof(int) + chunkSize;
+    }
+    return chunks;
+}
+
+} // namespace detail
+
+/* u = A v, computed from the matrix and vector streams of a SparseStream in
+ * the way k_spmv does, with a task for every processor. It stands in for
+ * the device when the layout of the streams is timed, the vector streams
+ * should hold v (see SparseStream::updateVector). */
+template <typename TStream, typename TVector>
+void spmvStream(const TStream& stream, TVector& u) {
+    using TVal = typename TStream::TVal;
+    using TIdx = typename TStream::TIdx;
+    const TIdx P = stream_config::processors;
+    const auto& upIndices = stream.getUpIndices();
+
+    std::vector<std::vector<const char*>> vectorChunks(P);
+    for (TIdx s = 0; s < P; ++s)
+        vectorChunks[s] = detail::rawChunks(stream.getVectorStream(s).data(),
+                                            stream.getVectorStream(s).size());
+
+    std::vector<std::vector<TVal>> partials(P);
+    hostThreadPool().parallelFor(P, [&](TIdx s) {
+        auto chunks =
+            detail::rawChunks(stream.getRawStream(s), stream.getRawStreamSize(s));
+        auto header = stream.getHeader(s);
+        const bool csr = header.layout == 1;
+        auto word = [](const char* chunk, std::size_t i) {
+            TIdx value;
+            std::memcpy(&value, chunk + i * sizeof(TIdx), sizeof(TIdx));
+            return value;
+        };
+        auto index = [&](const char* indices, std::size_t i) -> TIdx {
+            if (header.indexBytes == sizeof(uint16_t)) {
+                uint16_t value;
+                std::memcpy(&value, indices + i * sizeof(uint16_t),
+                            sizeof(uint16_t));
+                return value;
+            }
+            return word(indices, i);
+        };
+
+        auto& result = partials[s];
+        result.reserve(upIndices[s].size());
+        std::vector<TVal> v;
+        std::size_t position = 1;
+        for (TIdx strip = 0; strip < header.numStrips; ++strip) {
+            const char* stripHeader = chunks[position++];
+            const TIdx windows = word(stripHeader, 0);
+            const TIdx runs = word(stripHeader, 3);
+
+            // the local components, followed by the fetched runs
+            v.resize(word(stripHeader, 1));
+            std::memcpy(v.data(), vectorChunks[s][strip],
+                        v.size() * sizeof(TVal));
+            for (TIdx r = 0; r < runs; ++r) {
+                const TIdx owner = word(stripHeader, 4 + windows + r);
+                const TIdx start = word(stripHeader, 4 + windows + runs + r);
+                const TIdx length =
+                    word(stripHeader, 4 + windows + 2 * runs + r);
+                auto offset = v.size();
+                v.resize(offset + length);
+                std::memcpy(&v[offset],
+                            vectorChunks[owner][strip] + start * sizeof(TVal),
+                            length * sizeof(TVal));
+            }
+
+            for (TIdx w = 0; w < windows; ++w) {
+                const char* chunk = chunks[position++];
+                const TIdx sizeU = word(chunk, 0);
+                const TIdx windowSize = word(chunk, 1);
+                const TIdx rowEntries = csr ? sizeU + 1 : windowSize;
+                const char* rows = chunk + 2 * sizeof(TIdx);
+                const char* cols = rows + rowEntries * header.indexBytes;
+                const char* vals =
+                    rows + ((rowEntries + windowSize) * header.indexBytes + 3) /
+                               4 * 4;
+                auto value = [&](TIdx k) {
+                    TVal x;
+                    std::memcpy(&x, vals + k * sizeof(TVal), sizeof(TVal));
+                    return x;
+                };
+
+                const std::size_t base = result.size();
+                result.resize(base + sizeU, (TVal)0);
+                TVal* u = result.data() + base;
+                if (csr) {
+                    for (TIdx row = 0; row < sizeU; ++row)
+                        for (TIdx k = index(rows, row);
+                             k < index(rows, row + 1); ++k)
+                            u[row] += v[index(cols, k)] * value(k);
+                } else {
+                    for (TIdx k = 0; k < windowSize; ++k)
+                        u[index(rows, k)] += v[index(cols, k)] * value(k);
+                }
+            }
+        }
+    });
+
+    for (std::size_t i = 0; i < u.size(); ++i)
+        u.at(i) = (TVal)0;
+    for (TIdx s = 0; s < P; ++s)
+        for (std::size_t k = 0; k < partials[s].size(); ++k)
+            u.at(upIndices[s][k]) += partials[s][k];
+}
+
+/* The number of components of u that differ from A v computed on the host,
+ * relative to the sum of the absolute values of the terms of that row. */
+template <typename TMatrix, typename TVector>
+std::size_t verifySpMV(const TMatrix& A, const TVector& v, const TVector& u,
+                       double tolerance = 1e-4) {
+    using TVal = typename TMatrix::value_type;
+    std::vector<double> expected(A.getRows(), 0.0);
+    std::vector<double> scale(A.getRows(), 0.0);
+    for (const auto& image : A.getImages()) {
+        for (const auto& triplet : *image) {
+            double term = (double)triplet.value() * (double)v[triplet.col()];
+            expected[triplet.row()] += term;
+            scale[triplet.row()] += std::abs(term);
+        }
+    }
+
+    std::size_t mismatches = 0;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        double error = std::abs((double)(TVal)u[i] - expected[i]);
+        if (error > tolerance * std::max(scale[i], 1.0)) {
+            if (mismatches == 0)
+                ZeeLogError << "SpMV: u[" << i << "] = " << u[i]
+                            << ", expected " << expected[i] << endLog;
+            ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+} // namespace host
+
+} // namespace Zephany
@@ -1,13 +1,79 @@
+#pragma once
+
 extern "C" {
 #include <host_bsp.h>
 }
 
+#include <string>
+#include <vector>
+
 #include "streams/streams.hpp"
+#include "backend.hpp"
+#include "cannon.hpp"
+#include "streams/session.hpp"
+#include "host.hpp"
 
 namespace Zephany {
 
 using namespace Zee;
 
+namespace detail {
+
+// the inner block sizes for which k_cannon is compiled with a fixed size,
+// see CANNON_BLOCK_SIZES in the Makefile. Larger blocks do not fit in local
+// memory next to the program.
+constexpr unsigned int cannon_block_sizes[] = {8, 16, 24};
+
+/* The Cannon kernel for an inner block size, the variant that is compiled
+ * for that size if there is one. */
+inline std::string cannonKernel(unsigned int innerBlockSize) {
+    for (auto size : cannon_block_sizes)
+        if (size == innerBlockSize)
+            return "kernels/k_cannon_" + std::to_string(size) + ".srec";
+    return "kernels/k_cannon.srec";
+}
+
+/* The inner block size that a Cannon kernel is compiled for, or zero for
+ * the generic kernel. */
+inline unsigned int cannonKernelBlockSize(const std::string& kernel) {
+    const std::string prefix = "kernels/k_cannon_";
+    if (kernel.compare(0, prefix.size(), prefix) != 0)
+        return 0;
+    return (unsigned int)std::stoul(kernel.substr(prefix.size()));
+}
+
+/* Run k_spmv on the stream of A, for the vectors that were written to its
+ * vector streams. The partial sums of every vector are in the up streams. */
+template <typename TVal, typename TIdx>
+void runSparseProduct(const DStreamingSparseMatrix<TVal, TIdx>& A,
+                      SpMVUpStream<TVal, TIdx>& upStream) {
+    auto& session = Session::instance();
+    session.begin("kernels/k_spmv.srec");
+
+    const auto& stream = A.getStream();
+    TIdx vectors = stream.getVectorCount();
+    for (TIdx s = 0; s < stream_config::processors; ++s) {
+        ZeeAssertMsg(stream.localMemory(s, vectors) <=
+                         stream_config::buffer_memory,
+                     "The buffers of k_spmv do not fit in local memory, use "
+                     "smaller strips and windows or fewer vectors");
+        upStream.setChunkSize(s, stream.upStreamChunkSize(s) * vectors);
+        upStream.setTotalSize(s, stream.upStreamSize(s) * vectors);
+    }
+
+    stream.create();
+    upStream.createUp();
+
+    session.setTagSize(sizeof(int));
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        session.sendDown(s, 0, &vectors, sizeof(int));
+
+    // Run the program on the Epiphany cores
+    session.run();
+}
+
+} // namespace detail
+
 /*** OPERATIONS ***/
 template <typename TVal, typename TIdx>
 DStreamingVector<TVal, TIdx> perform_operation(
@@ -17,38 +83,113 @@ DStreamingVector<TVal, TIdx> perform_operation(
 {
     const auto& A = op.getLHS();
     const auto& v = op.getRHS();
-    DStreamingVector<TVal, TIdx> u(A.getRows(), 1.0);
+    DStreamingVector<TVal, TIdx> u(A.getRows(), 0.0);
+
+    if (getBackend() == execution_backend::host) {
+        host::spmv(A, v, u);
+        return u;
+    }
 
     ZeeLogInfo << "SpMV on Epiphany" << endLog;
     ZeeLogVar(A.nonZeros());
     ZeeLogVar(v.size());
 
-    // Initialize the BSP system
-    bsp_init("kernels/k_spmv.srec", 0, 0);
+    // the matrix stream is reused, only the vector is written again
+    auto& stream = A.getStream();
+    stream.updateVector(v);
+    SpMVUpStream<TVal, TIdx> upStream;
+    detail::runSparseProduct(A, upStream);
 
-    // Initialize the Epiphany system and load the binary
-    bsp_begin(bsp_nprocs());
+    // Add the partial sums of the windows to u
+    upStream.fill(u, stream);
 
-    const auto& stream = A.getStream();
+    if (getVerification()) {
+        auto mismatches = host::verifySpMV(A, v, u);
+        ZeeAssertMsg(mismatches == 0, "SpMV differs from the host product");
+        (void)mismatches;
+    }
+
+    return u;
+}
+
+/* U = A X for a block of vectors X, that are distributed alike. The windows
+ * of A are streamed once, and every nonzero is applied to all vectors. */
+template <typename TVal, typename TIdx>
+std::vector<DStreamingVector<TVal, TIdx>>
+spmm(const DStreamingSparseMatrix<TVal, TIdx>& A,
+     const std::vector<DStreamingVector<TVal, TIdx>>& X) {
+    ZeeAssert(!X.empty());
+
+    std::vector<DStreamingVector<TVal, TIdx>> U;
+    U.reserve(X.size());
+    for (std::size_t j = 0; j < X.size(); ++j)
+        U.emplace_back(A.getRows(), 0.0);
+
+    if (getBackend() == execution_backend::host) {
+        for (std::size_t j = 0; j < X.size(); ++j)
+            host::spmv(A, X[j], U[j]);
+        return U;
+    }
+
+    ZeeLogInfo << "SpMM on Epiphany" << endLog;
+    ZeeLogVar(A.nonZeros());
+    ZeeLogVar(X.size());
+
+    auto& stream = A.getStream();
+    stream.updateVectors(X);
     SpMVUpStream<TVal, TIdx> upStream;
-    for (TIdx s = 0; s < stream_config::processors; ++s) {
-        upStream.setChunkSize(s, stream.upStreamChunkSize(s));
-        upStream.setTotalSize(s, stream.upStreamSize(s));
+    detail::runSparseProduct(A, upStream);
+
+    upStream.fill(U, stream);
+
+    if (getVerification()) {
+        std::size_t mismatches = 0;
+        for (std::size_t j = 0; j < X.size(); ++j)
+            mismatches += host::verifySpMV(A, X[j], U[j]);
+        ZeeAssertMsg(mismatches == 0, "SpMM differs from the host product");
+        (void)mismatches;
     }
 
-    stream.create();
-    upStream.createUp();
+    return U;
+}
 
-    // Run the program on the Epiphany cores
-    ebsp_spmd();
+/* U = A X for a tall and skinny matrix X, whose columns are multiplied at
+ * once as in spmm(A, X) for vectors. The columns are distributed like the
+ * vector that the stream of A was prepared for. */
+template <typename TVal, typename TIdx>
+DStreamingMatrix<TVal, TIdx>
+spmm(const DStreamingSparseMatrix<TVal, TIdx>& A,
+     const DStreamingMatrix<TVal, TIdx>& X) {
+    ZeeAssert(X.getRows() == A.getCols());
+    const TIdx rows = X.getRows();
+    const TIdx vectors = X.getCols();
 
-    // Gather U
-    upStream.fill(u, stream);
+    // X is extracted row major in one pass, and split into its columns
+    std::vector<TVal> data;
+    X.extract(data);
+    const std::vector<TIdx>* owners =
+        A.hasStream() ? &A.getStream().getVector().getOwners() : nullptr;
+    std::vector<DStreamingVector<TVal, TIdx>> columns(
+        vectors, DStreamingVector<TVal, TIdx>(rows, 0.0));
+    for (TIdx i = 0; i < rows; ++i) {
+        for (TIdx j = 0; j < vectors; ++j) {
+            columns[j].at(i) = data[(std::size_t)i * vectors + j];
+            if (owners)
+                columns[j].reassign(i, (*owners)[i]);
+        }
+    }
 
-    // Finalize
-    bsp_end();
+    auto U = spmm(A, columns);
 
-    return u;
+    data.resize((std::size_t)A.getRows() * vectors);
+    for (TIdx j = 0; j < vectors; ++j)
+        for (TIdx i = 0; i < A.getRows(); ++i)
+            data[(std::size_t)i * vectors + j] = U[j][i];
+
+    DStreamingMatrix<TVal, TIdx> result(X.getStream().getInnerBlockSize(),
+                                        A.getRows(), vectors);
+    result.fill(data);
+    return result;
 }
 
 template <typename TVal, typename TIdx>
@@ -61,52 +202,93 @@ DStreamingMatrix<TVal, TIdx> perform_operation(
     auto& B = op.getRHS();
 
     ZeeAssert(A.getCols() == B.getRows());
+    ZeeAssertMsg(A.getStream().getInnerBlockSize() ==
+                     B.getStream().getInnerBlockSize(),
+                 "The operands have to have the same inner block size");
 
     // put result in new matrix C
     DStreamingMatrix<TVal, TIdx> C(A.getStream().getInnerBlockSize(),
-                                   A.getRows());
+                                   A.getRows(), B.getCols());
 
-    // Initialize the BSP system
-    bsp_init("kernels/k_cannon.srec", 0, 0);
-
-    bsp_begin(stream_config::processors);
+    if (getBackend() == execution_backend::host) {
+        host::cannon(A.getStream(), B.getStream(), C.getStream());
+        return C;
+    }
 
     const auto& lhsStream = A.getStream();
     const auto& rhsStream = B.getStream();
-    ZeeAssert(lhsStream.getOrientation() == stream_orientation::left_handed);
-    ZeeAssert(rhsStream.getOrientation() == stream_orientation::right_handed);
 
     TIdx innerBlockSize = lhsStream.getInnerBlockSize();
-    TIdx outerBlocks = lhsStream.getOuterBlocks();
+
+    // a variant that is started with another inner block size would not
+    // compute anything, so this is checked here rather than on the device
+    auto kernel = detail::cannonKernel(innerBlockSize);
+    ZeeAssertMsg(detail::cannonKernelBlockSize(kernel) == 0 ||
+                     detail::cannonKernelBlockSize(kernel) == innerBlockSize,
+                 "The Cannon kernel is compiled for another inner block size");
+
+    auto& session = Session::instance();
+    session.begin(kernel);
+    // C has outerRows x outerCols outer blocks, and A and B share
+    // outerBlocks outer blocks along their inner dimension
+    TIdx outerRows = lhsStream.getOuterRows();
+    TIdx outerBlocks = lhsStream.getOuterCols();
+    TIdx outerCols = rhsStream.getOuterCols();
     TIdx N = stream_config::N;
 
+    auto plan = planCannon<TVal>(innerBlockSize, outerRows, outerBlocks,
+                                 outerCols, getCannonSchedule());
+    TIdx tileRows = plan.tileRows;
+    TIdx tileCols = plan.tileCols;
+    // the streams of the operands are padded to whole tiles of C
+    TIdx paddedRows = plan.paddedRows;
+    TIdx paddedCols = plan.paddedCols;
+    // the buffers have to leave room for the program and its stack
+    ZeeAssertMsg(plan.localMemory <= detail::cannon_tile_memory,
+                 "The inner blocks do not fit in local memory");
+
+    // the kernel moves through the streams according to their orientation
+    int lhsOrientation = lhsStream.streamedOrientation(tileRows) ==
+                         stream_orientation::right_handed;
+    int rhsOrientation = rhsStream.streamedOrientation(tileCols) ==
+                         stream_orientation::right_handed;
+
+    // the kernel sends up a tile of C at a time
     UpStream<TVal> upStream;
-    upStream.setChunkSize(innerBlockSize * innerBlockSize * sizeof(float));
-    upStream.setTotalSize(outerBlocks * outerBlocks * innerBlockSize *
+    upStream.setChunkSize(tileRows * tileCols * innerBlockSize *
+                          innerBlockSize * sizeof(float));
+    upStream.setTotalSize(paddedRows * paddedCols * innerBlockSize *
                           innerBlockSize * sizeof(float));
 
-    lhsStream.create();
-    rhsStream.create();
+    lhsStream.create(cannon_operand::lhs, tileRows);
+    rhsStream.create(cannon_operand::rhs, tileCols);
     upStream.createUp();
 
     // send Cannon parameters down to the kernel
-    int tagsize = sizeof(int);
-    ebsp_set_tagsize(&tagsize);
-
+    session.setTagSize(sizeof(int));
     for (TIdx s = 0; s < stream_config::processors; ++s) {
-        int tag = 0;
-        ebsp_send_down(s, &tag, &innerBlockSize, sizeof(int));
-        tag = 1;
-        ebsp_send_down(s, &tag, &outerBlocks, sizeof(int));
-        tag = 2;
-        ebsp_send_down(s, &tag, &N, sizeof(int));
+        session.sendDown(s, 0, &innerBlockSize, sizeof(int));
+        session.sendDown(s, 1, &outerBlocks, sizeof(int));
+        session.sendDown(s, 2, &N, sizeof(int));
+        session.sendDown(s, 3, &lhsOrientation, sizeof(int));
+        session.sendDown(s, 4, &rhsOrientation, sizeof(int));
+        session.sendDown(s, 5, &tileRows, sizeof(int));
+        session.sendDown(s, 6, &tileCols, sizeof(int));
+        session.sendDown(s, 7, &paddedRows, sizeof(int));
+        session.sendDown(s, 8, &paddedCols, sizeof(int));
     }
 
-    ebsp_spmd();
-
-    C.fillWithUpStream(upStream);
+    session.run();
 
-    bsp_end();
+    // When the tiles are single rows of outer blocks, or span all columns,
+    // and they are not padded, the up stream already has the layout of C,
+    // so C keeps using it until the session needs the memory again.
+    // Otherwise the tiles are copied into place.
+    bool padded = paddedRows != outerRows || paddedCols != outerCols;
+    if (!padded && (tileRows == 1 || tileCols == outerCols))
+        C.adoptUpStream(upStream, session.region());
+    else
+        C.getStream().untile(upStream.getRawData(), tileRows, tileCols);
 
     return C;
 }
@@ -0,0 +1,20 @@
+#pragma once
+
+#ifndef ZEPHANY_MESH_SIZE
+#define ZEPHANY_MESH_SIZE 4
+#endif
+
+namespace Zephany {
+
+namespace stream_config {
+static constexpr unsigned int N = ZEPHANY_MESH_SIZE;
+static constexpr unsigned int processors = N * N;
+// the local memory of a core, which holds the program, its stack and the
+// buffers of the streams
+static constexpr unsigned int local_memory = 32 * 1024;
+// the local memory that the buffers of a kernel may use, the remainder holds
+// the program and its stack
+static constexpr unsigned int buffer_memory = local_memory - 8 * 1024;
+}
+
+} // namespace Zephany
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <zee.hpp>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "config.hpp"
+
+namespace Zephany {
+
+/* Host objects can alias external memory of the BSP system (e.g. the buffers
+ * of an up stream) instead of copying it. An alias has to take a private copy
+ * of the data once the memory is going to be reused or freed. */
+class ExternalAlias {
+  public:
+    virtual ~ExternalAlias() = default;
+    virtual void takeCopy() = 0;
+};
+
+/* A region of external memory with its aliases, reclaim() is called by the
+ * owner of the memory before it is reused or freed. */
+class ExternalRegion {
+  public:
+    void attach(std::weak_ptr<ExternalAlias> alias) {
+        aliases_.push_back(alias);
+    }
+
+    void reclaim() {
+        for (auto& alias : aliases_)
+            if (auto target = alias.lock())
+                target->takeCopy();
+        aliases_.clear();
+    }
+
+  private:
+    std::vector<std::weak_ptr<ExternalAlias>> aliases_;
+};
+
+/* One buffer per processor, pointing into external memory until it has been
+ * reclaimed, after which it points to a private copy. */
+template <typename T>
+class AliasedBuffers : public ExternalAlias {
+  public:
+    AliasedBuffers(const std::array<T*, stream_config::processors>& buffers,
+                   std::size_t elements)
+        : buffers_(buffers), elements_(elements) {}
+
+    T* buffer(unsigned int s) const { return buffers_[s]; }
+    std::size_t elements() const { return elements_; }
+
+    void takeCopy() override {
+        for (unsigned int s = 0; s < stream_config::processors; ++s) {
+            copies_[s].assign(buffers_[s], buffers_[s] + elements_);
+            buffers_[s] = copies_[s].data();
+        }
+    }
+
+  private:
+    std::array<T*, stream_config::processors> buffers_;
+    std::array<std::vector<T>, stream_config::processors> copies_;
+    std::size_t elements_;
+};
+
+} // namespace Zephany
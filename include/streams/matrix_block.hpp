@@ -1,20 +1,36 @@
 
-/* Stream definition for an n x n dense matrix.
+/* Stream definition for an m x n dense matrix.
  * for a processor mesh of size N x N. The matrix is stored
- * in M x M 'outer blocks', and each outer block is split into
- * N x N smaller inner blocks.
+ * in M_r x M_c 'outer blocks', and each outer block is split into
+ * N x N smaller inner blocks. The outer blocks at the bottom and right
+ * edges are padded with zeros in the stream.
  *
- * isRowMajor_ defines the orientation: In an operation C = A * B
- * we want to store:
- * A: A_11 A_12 ... A_1M (repeat M) A_21 ... A_2M (repeat M) ... A_MM (repeat M)
- * B: B_11 B_21 ... B_M1 B_12 ... B_M2 ... B_MM (repeat M)
- * We call orientation of A (left-hand side) row major, and B column major
- * and we need to be able to switch between these oreitnations.
+ * The outer blocks are always stored in row major order. The orientation
+ * is a property of the view, and decides the order in which panels of
+ * outer blocks are streamed down:
+ * left-handed:  A_11 A_12 ... A_1M_c A_21 ... A_M_rM_c
+ * right-handed: A_11 A_21 ... A_M_r1 A_12 ... A_M_rM_c
+ *
+ * Streams of single outer blocks are created from the stored buffers in
+ * row major order, whatever the orientation. Kernels are told the order of
+ * their streams (see streamedOrientation), and move the cursor to the
+ * chunks they need, so these do not require moving data.
+ *
+ * For the tiled schedule of Cannon's algorithm, the operands are streamed
+ * in panels of g outer blocks: a chunk of the lhs holds g outer blocks
+ * in a column, A_{gI, K} ... A_{gI + g - 1, K}, and a chunk of the rhs g
+ * outer blocks in a row, B_{K, gJ} ... B_{K, gJ + g - 1}. The panels are
+ * gathered on the host, in the order of the orientation, and padded with
+ * zero blocks when g does not divide the number of outer blocks. They are
+ * kept with the stream until it is written to, so that products with the
+ * same operands gather them once.
  */
 
 #pragma once
 
 #include "streams.hpp"
+#include "external.hpp"
+#include "session.hpp"
 
 namespace Zephany {
 
@@ -22,140 +38,415 @@ namespace Zephany {
 // RHS orientation is column major
 enum class stream_orientation { left_handed, right_handed };
 
+// The operands of Cannon's algorithm are skewed over the processors
+enum class cannon_operand { none, lhs, rhs };
+
+/* Describes how a matrix is laid out over the processor buffers, streams with
+ * equal layouts have interchangeable buffers. */
+template <typename TIdx>
+struct MatrixBlockLayout {
+    TIdx innerBlocks;
+    TIdx innerBlockSize;
+    TIdx outerRows;
+    TIdx outerCols;
+
+    bool operator==(const MatrixBlockLayout& other) const {
+        return innerBlocks == other.innerBlocks &&
+               innerBlockSize == other.innerBlockSize &&
+               outerRows == other.outerRows && outerCols == other.outerCols;
+    }
+
+    TIdx elementsPerProcessor() const {
+        return outerRows * outerCols * innerBlockSize * innerBlockSize;
+    }
+};
+
 template <typename T, typename TIdx = Zee::default_index_type>
 class MatrixBlockStream : public Stream<T, TIdx> {
   public:
     MatrixBlockStream(stream_direction direction)
         : Stream<T, TIdx>(direction) {}
 
-    /* Switch stream arrangement (for LHS/RHS of matrix operations) */
+    /* Switch the order in which the stream is created, this does not touch
+     * the data. */
     void setOrientation(stream_orientation orientation) {
-        if (orientation_ == orientation)
+        orientation_ = orientation;
+    }
+
+    stream_orientation getOrientation() const { return orientation_; }
+
+    MatrixBlockLayout<TIdx> getLayout() const {
+        return {innerBlocks_, innerBlockSize_, outerRows_, outerCols_};
+    }
+
+    /* Use the given buffers, e.g. those of an up stream, as the data of this
+     * stream without copying them. The buffers have to be laid out according
+     * to `layout`, which has to equal the layout of this stream. Copies of
+     * this stream share the buffers for reading, a stream that is written
+     * to takes a private copy first. */
+    void alias(const std::array<T*, stream_config::processors>& buffers,
+               const MatrixBlockLayout<TIdx>& layout, ExternalRegion& region) {
+        ZeeAssert(layout == getLayout());
+
+        alias_ = std::make_shared<AliasedBuffers<T>>(
+            buffers, layout.elementsPerProcessor());
+        region.attach(alias_);
+
+        for (auto& data : this->data_)
+            std::vector<T>().swap(data);
+        panels_.reset();
+    }
+
+    bool isAliased() const { return (bool)alias_; }
+
+    /* Replace aliased buffers by a private copy. */
+    void detach() {
+        if (!alias_)
             return;
 
-        transposeStream_();
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            this->data_[s].assign(alias_->buffer(s),
+                                  alias_->buffer(s) + alias_->elements());
+        }
+        alias_.reset();
+    }
+
+    /* Writable data of processor s, aliased buffers are detached first so
+     * that copies of the stream are not changed. */
+    T* buffer(TIdx s) {
+        detach();
+        panels_.reset();
+        return this->data_[s].data();
+    }
 
-        orientation_ = orientation;
+    const T* buffer(TIdx s) const {
+        return alias_ ? alias_->buffer(s) : this->data_[s].data();
     }
 
-    stream_orientation getOrientation() const { return orientation_; }
+    std::array<std::vector<T>, stream_config::processors>& getData() {
+        detach();
+        panels_.reset();
+        return this->data_;
+    }
+
+    const std::array<std::vector<T>, stream_config::processors>&
+    getData() const {
+        ZeeAssertMsg(!alias_, "aliased streams have to be accessed through "
+                              "buffer(s), or detached first");
+        return this->data_;
+    }
 
     void setInner(TIdx count, TIdx size) {
         innerBlocks_ = count;
         innerBlockSize_ = size;
     }
 
-    void setOuter(TIdx count, TIdx size) {
-        outerBlocks_ = count;
+    void setOuter(TIdx rows, TIdx cols, TIdx size) {
+        outerRows_ = rows;
+        outerCols_ = cols;
         outerBlockSize_ = size;
     }
 
     TIdx getInnerBlockSize() const { return innerBlockSize_; }
-    TIdx getOuterBlocks() const { return outerBlocks_; }
+    TIdx getOuterRows() const { return outerRows_; }
+    TIdx getOuterCols() const { return outerCols_; }
     TIdx getOuterBlockSize() const { return outerBlockSize_; }
 
-    void setMatrixSize(TIdx matrixSize) { matrixSize_ = matrixSize; }
+    void setMatrixSize(TIdx rows, TIdx cols) {
+        matrixRows_ = rows;
+        matrixCols_ = cols;
+    }
 
     void reshape() {
+        alias_.reset();
+        panels_.reset();
         for (TIdx s = 0; s < stream_config::processors; ++s) {
-            this->data_[s].resize(outerBlocks_ * outerBlocks_ *
-                                  innerBlockSize_ * innerBlockSize_);
+            this->data_[s].resize(outerRows_ * outerCols_ * innerBlockSize_ *
+                                  innerBlockSize_);
         }
     }
 
-    // Note: This is really show, and should not be used to loop over matrix
-    // we always optimize for size on Epiphany.
+    // Note: This is really slow, and should not be used to loop over matrix
+    // we always optimize for size on Epiphany. Use fill, generate and extract
+    // to access the matrix as a whole.
     T& element(TIdx i, TIdx j) {
-        // see which global block:
-        TIdx outerBlockI = i / outerBlockSize_;
-        TIdx outerBlockJ = j / outerBlockSize_;
-
-        i -= outerBlockI * outerBlockSize_;
-        j -= outerBlockJ * outerBlockSize_;
-
-        // Get inner block
-        TIdx innerBlockI = i / innerBlockSize_;
-        TIdx innerBlockJ = j / innerBlockSize_;
-
-        i -= innerBlockI * innerBlockSize_;
-        j -= innerBlockJ * innerBlockSize_;
-
-        return this
-            ->data_[innerBlockI * innerBlocks_ +
-                    innerBlockJ][(outerBlockI * outerBlocks_ + outerBlockJ) *
-                                     innerBlockSize_ * innerBlockSize_ +
-                                 i * innerBlockSize_ + j];
+        return buffer(processorOf_(i, j))[offsetOf_(i, j)];
     }
 
     const T& element(TIdx i, TIdx j) const {
-        // see which global block:
-        TIdx outerBlockI = i / outerBlockSize_;
-        TIdx outerBlockJ = j / outerBlockSize_;
-
-        i -= outerBlockI * outerBlockSize_;
-        j -= outerBlockJ * outerBlockSize_;
+        return buffer(processorOf_(i, j))[offsetOf_(i, j)];
+    }
 
-        // Get inner block
-        TIdx innerBlockI = i / innerBlockSize_;
-        TIdx innerBlockJ = j / innerBlockSize_;
+    /* Copy a row major matrix, with rows of length `ld`, into the stream. */
+    void fill(const T* data, TIdx ld) {
+        forEachBlockRow_([this](TIdx s) { return buffer(s); },
+                         [&](TIdx i, TIdx j, TIdx length, T* row) {
+                             std::copy(data + i * ld + j,
+                                       data + i * ld + j + length, row);
+                         });
+    }
 
-        i -= innerBlockI * innerBlockSize_;
-        j -= innerBlockJ * innerBlockSize_;
+    /* Set element (i, j) to f(i, j). */
+    template <typename TFunc>
+    void generate(TFunc f) {
+        forEachBlockRow_([this](TIdx s) { return buffer(s); },
+                         [&](TIdx i, TIdx j, TIdx length, T* row) {
+                             for (TIdx k = 0; k < length; ++k)
+                                 row[k] = f(i, j + k);
+                         });
+    }
 
-        return this
-            ->data_[innerBlockI * innerBlocks_ +
-                    innerBlockJ][(outerBlockI * outerBlocks_ + outerBlockJ) *
-                                     innerBlockSize_ * innerBlockSize_ +
-                                 i * innerBlockSize_ + j];
+    /* Copy the stream into a row major matrix, with rows of length `ld`. */
+    void extract(T* data, TIdx ld) const {
+        forEachBlockRow_([this](TIdx s) { return buffer(s); },
+                         [&](TIdx i, TIdx j, TIdx length, const T* row) {
+                             std::copy(row, row + length, data + i * ld + j);
+                         });
     }
 
     void computeChunkSize() {
         ZeeAssert(innerBlocks_ != 0);
         ZeeAssert(innerBlockSize_ != 0);
-        ZeeAssert(outerBlocks_ != 0);
-        ZeeAssert(matrixSize_ != 0);
+        ZeeAssert(outerRows_ != 0 && outerCols_ != 0);
+        ZeeAssert(matrixRows_ != 0 && matrixCols_ != 0);
 
         this->chunkSize_ = innerBlockSize_ * innerBlockSize_ * sizeof(T);
-        this->totalSize_ = outerBlocks_ * outerBlocks_ * this->chunkSize_;
+        this->totalSize_ = outerRows_ * outerCols_ * this->chunkSize_;
     }
 
-    void create() const override {
+    /* The stored chunk that is streamed down at `position`. */
+    TIdx streamedChunk(TIdx position) const {
+        if (orientation_ == stream_orientation::left_handed)
+            return position;
+        return chunkIndex_(position % outerRows_, position / outerRows_);
+    }
+
+    /* The order in which a stream of panels of `tileSize` outer blocks is
+     * created, single outer blocks are streamed in the stored order. */
+    stream_orientation streamedOrientation(TIdx tileSize) const {
+        return tileSize == 1 ? stream_orientation::left_handed : orientation_;
+    }
+
+    void create() const override { create(cannon_operand::none); }
+
+    /* Create the stream for use as an operand of Cannon's algorithm, in
+     * which processor (s, t) starts with the inner blocks (s, k) of the lhs
+     * and (k, t) of the rhs, with k = -(s + t) mod N. The skew is obtained by
+     * streaming the buffer of another processor. The chunks are panels of
+     * `tileSize` outer blocks, in a column of the lhs or a row of the rhs,
+     * which are gathered on the host. Single outer blocks are streamed from
+     * the stored buffers without moving data. */
+    void create(cannon_operand operand, TIdx tileSize = 1) const {
         ZeeAssert(this->chunkSize_ != 0);
         ZeeAssert(this->totalSize_ != 0);
+        ZeeAssert(tileSize == 1 || operand != cannon_operand::none);
+
+        TIdx chunkSize = this->getChunkSize() * tileSize;
+
+        auto& session = Session::instance();
+        if (tileSize == 1) {
+            for (TIdx s = 0; s < stream_config::processors; s++) {
+                session.createDownStream(
+                    (const void*)buffer(source_(s, operand)), s,
+                    this->getTotalSize(), chunkSize);
+            }
+            return;
+        }
 
-        TIdx totalSize = this->getTotalSize();
-        TIdx chunkSize = this->getChunkSize();
+        const auto& panels = gatherPanels_(operand, tileSize);
+        const TIdx totalSize = panels.buffers[0].size() * sizeof(T);
         for (TIdx s = 0; s < stream_config::processors; s++) {
-            ebsp_create_down_stream((void*)(this->data_[s].data()), s, totalSize,
-                                    chunkSize);
+            session.createDownStream(
+                (const void*)panels.buffers[source_(s, operand)].data(), s,
+                totalSize, chunkSize, panels.key);
         }
     }
 
-  private:
-    void transposeStream_() {
-        // row major blocks to column major
-        TIdx chunkElements = this->innerBlockSize_ * this->innerBlockSize_;
-        for (TIdx s = 0; s < stream_config::N * stream_config::N; ++s) {
-            for (TIdx chunkI = 0; chunkI < outerBlocks_; ++chunkI)
-                for (TIdx chunkJ = chunkI + 1; chunkJ < outerBlocks_; ++chunkJ) {
-                    TIdx chunkOriginal = chunkI * outerBlocks_ + chunkJ;
-                    TIdx chunkTarget = chunkJ * outerBlocks_ + chunkI;
-                    TIdx offset = chunkOriginal * chunkElements;
-                    TIdx targetOffset = chunkTarget * chunkElements;
-                    std::swap_ranges(this->data_[s].begin() + offset,
-                                     this->data_[s].begin() + offset +
-                                         chunkElements,
-                                     this->data_[s].begin() + targetOffset);
+    /* Copy the buffers of an up stream of k_cannon into the stream, in
+     * which the tiles of `tileRows` x `tileCols` outer blocks are in row
+     * major order, and so are the outer blocks of every tile. The outer
+     * blocks that pad the tiles beyond the matrix are skipped. */
+    void untile(const std::array<T*, stream_config::processors>& buffers,
+                TIdx tileRows, TIdx tileCols) {
+        const TIdx chunkElements = innerBlockSize_ * innerBlockSize_;
+        const TIdx rowTiles = (outerRows_ + tileRows - 1) / tileRows;
+        const TIdx colTiles = (outerCols_ + tileCols - 1) / tileCols;
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            T* data = buffer(s);
+            const T* chunk = buffers[s];
+            for (TIdx tileI = 0; tileI < rowTiles; ++tileI)
+            for (TIdx tileJ = 0; tileJ < colTiles; ++tileJ)
+            for (TIdx a = 0; a < tileRows; ++a)
+            for (TIdx b = 0; b < tileCols; ++b) {
+                const TIdx i = tileI * tileRows + a;
+                const TIdx j = tileJ * tileCols + b;
+                if (i < outerRows_ && j < outerCols_) {
+                    std::copy(chunk, chunk + chunkElements,
+                              data + chunkIndex_(i, j) * chunkElements);
                 }
+                chunk += chunkElements;
+            }
+        }
+    }
+
+  private:
+    // The stored buffers gathered into panels, for every processor
+    struct Panels {
+        cannon_operand operand;
+        TIdx tileSize;
+        stream_orientation orientation;
+        std::uint64_t key;
+        std::array<std::vector<T>, stream_config::processors> buffers;
+    };
+
+    // The panels of `tileSize` outer blocks, gathered when they are first
+    // needed after the stream was written to
+    const Panels& gatherPanels_(cannon_operand operand,
+                                TIdx tileSize) const {
+        if (panels_ && panels_->operand == operand &&
+            panels_->tileSize == tileSize &&
+            panels_->orientation == orientation_)
+            return *panels_;
+
+        auto panels = std::make_shared<Panels>();
+        panels->operand = operand;
+        panels->tileSize = tileSize;
+        panels->orientation = orientation_;
+        panels->key = Session::uniqueKey();
+
+        // the dimension along the panels is padded to a multiple of g
+        const TIdx chunkElements = innerBlockSize_ * innerBlockSize_;
+        const TIdx chunks =
+            operand == cannon_operand::lhs
+                ? roundUp_(outerRows_, tileSize) * outerCols_
+                : outerRows_ * roundUp_(outerCols_, tileSize);
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            auto& ordered = panels->buffers[s];
+            ordered.assign(chunks * chunkElements, (T)0);
+            const T* data = buffer(s);
+            for (TIdx position = 0; position < chunks; ++position) {
+                TIdx index = panelChunk_(operand, tileSize, position);
+                if (index == outerRows_ * outerCols_)
+                    continue;
+                const T* chunk = data + index * chunkElements;
+                std::copy(chunk, chunk + chunkElements,
+                          ordered.data() + position * chunkElements);
+            }
+        }
+
+        panels_ = panels;
+        return *panels_;
+    }
+
+    static TIdx roundUp_(TIdx count, TIdx multiple) {
+        return (count + multiple - 1) / multiple * multiple;
+    }
+
+    // The stored chunk of the outer block that is streamed down at
+    // `position`, when the stream is made of panels of `tileSize` outer
+    // blocks, or M_r M_c for a block that pads the last panel. Panels are
+    // oriented like outer blocks.
+    TIdx panelChunk_(cannon_operand operand, TIdx tileSize,
+                     TIdx position) const {
+        const TIdx panel = position / tileSize;
+        const TIdx block = position % tileSize;
+        const bool leftHanded =
+            orientation_ == stream_orientation::left_handed;
+        if (operand == cannon_operand::lhs) {
+            // a grid of M_r / g x M_c panels, of blocks in a column
+            const TIdx rows = roundUp_(outerRows_, tileSize) / tileSize;
+            const TIdx cols = outerCols_;
+            TIdx i = leftHanded ? panel / cols : panel % rows;
+            TIdx j = leftHanded ? panel % cols : panel / rows;
+            if (i * tileSize + block >= outerRows_)
+                return outerRows_ * outerCols_;
+            return chunkIndex_(i * tileSize + block, j);
+        }
+
+        // a grid of M_r x M_c / g panels, of blocks in a row
+        const TIdx rows = outerRows_;
+        const TIdx cols = roundUp_(outerCols_, tileSize) / tileSize;
+        TIdx i = leftHanded ? panel / cols : panel % rows;
+        TIdx j = leftHanded ? panel % cols : panel / rows;
+        if (j * tileSize + block >= outerCols_)
+            return outerRows_ * outerCols_;
+        return chunkIndex_(i, j * tileSize + block);
+    }
+
+    // the processor whose buffer is streamed to processor s
+    TIdx source_(TIdx s, cannon_operand operand) const {
+        const TIdx si = s / innerBlocks_;
+        const TIdx sj = s % innerBlocks_;
+        const TIdx k = (2 * innerBlocks_ - si - sj) % innerBlocks_;
+        switch (operand) {
+        case cannon_operand::lhs:
+            return si * innerBlocks_ + k;
+        case cannon_operand::rhs:
+            return k * innerBlocks_ + sj;
+        default:
+            return s;
+        }
+    }
+
+    TIdx chunkIndex_(TIdx outerBlockI, TIdx outerBlockJ) const {
+        return outerBlockI * outerCols_ + outerBlockJ;
+    }
+
+    TIdx processorOf_(TIdx i, TIdx j) const {
+        return ((i % outerBlockSize_) / innerBlockSize_) * innerBlocks_ +
+               (j % outerBlockSize_) / innerBlockSize_;
+    }
+
+    TIdx offsetOf_(TIdx i, TIdx j) const {
+        return chunkIndex_(i / outerBlockSize_, j / outerBlockSize_) *
+                   innerBlockSize_ * innerBlockSize_ +
+               (i % innerBlockSize_) * innerBlockSize_ + j % innerBlockSize_;
+    }
+
+    /* Call f(i, j, length, row) for every row of every inner block, where
+     * `row` points to the stream data of the elements (i, j), ...,
+     * (i, j + length - 1), and buffer(s) gives the data of processor s. Rows
+     * and columns that only hold padding are skipped. */
+    template <typename TBuffer, typename TFunc>
+    void forEachBlockRow_(TBuffer buffer, TFunc f) const {
+        const TIdx chunkElements = innerBlockSize_ * innerBlockSize_;
+        for (TIdx outerI = 0; outerI < outerRows_; ++outerI)
+        for (TIdx innerI = 0; innerI < innerBlocks_; ++innerI)
+        for (TIdx i = 0; i < innerBlockSize_; ++i) {
+            TIdx globalI =
+                outerI * outerBlockSize_ + innerI * innerBlockSize_ + i;
+            if (globalI >= matrixRows_)
+                return;
+
+            for (TIdx outerJ = 0; outerJ < outerCols_; ++outerJ)
+            for (TIdx innerJ = 0; innerJ < innerBlocks_; ++innerJ) {
+                TIdx globalJ =
+                    outerJ * outerBlockSize_ + innerJ * innerBlockSize_;
+                if (globalJ >= matrixCols_)
+                    break;
+
+                TIdx length = std::min(innerBlockSize_, matrixCols_ - globalJ);
+                f(globalI, globalJ, length,
+                  buffer(innerI * innerBlocks_ + innerJ) +
+                      chunkIndex_(outerI, outerJ) * chunkElements +
+                      i * innerBlockSize_);
+            }
         }
     }
 
     stream_orientation orientation_ = stream_orientation::left_handed;
     TIdx innerBlocks_ = 0;
     TIdx innerBlockSize_ = 0;
-    TIdx outerBlocks_ = 0;
+    TIdx outerRows_ = 0;
+    TIdx outerCols_ = 0;
     TIdx outerBlockSize_ = 0;
-    TIdx matrixSize_ = 0;
+    TIdx matrixRows_ = 0;
+    TIdx matrixCols_ = 0;
+
+    std::shared_ptr<AliasedBuffers<T>> alias_;
+    // panels are shared by copies of the stream, and dropped when it is
+    // written to
+    mutable std::shared_ptr<const Panels> panels_;
 };
 
 } // namespace Zephany
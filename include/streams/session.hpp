@@ -0,0 +1,342 @@
+#pragma once
+
+extern "C" {
+#include <host_bsp.h>
+}
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+#include "external.hpp"
+
+namespace Zephany {
+
+struct SessionStatistics {
+    // bsp_init and bsp_begin, i.e. loading a kernel and booting the system
+    unsigned long initializations = 0;
+    // calls to ebsp_spmd
+    unsigned long runs = 0;
+    unsigned long streamsCreated = 0;
+    unsigned long streamsReused = 0;
+    // reused streams whose contents did not have to be written again
+    unsigned long streamsUnchanged = 0;
+
+    double initSeconds = 0.0;
+    double streamSeconds = 0.0;
+    double runSeconds = 0.0;
+};
+
+/* The BSP system that is shared by all operations on the device.
+ *
+ * An operation is recorded between begin() and run(): the streams it creates
+ * and the messages it sends down. The system is booted once and kept running
+ * between operations. On run() the streams are compared to those of the
+ * previous operation, and when the kernel and the stream shapes match the new
+ * data is written into the existing external memory, so that the kernel does
+ * not have to be loaded again. Otherwise the system is restarted. The streams
+ * belong to the system that is started for one kernel, so only the kernel of
+ * the last operation is kept loaded and alternating kernels restart it.
+ *
+ * Results can alias the external memory of the system (see ExternalRegion),
+ * these take a copy of their data before the memory is reused or freed.
+ *
+ * The session is not synchronized. A thread can reserve it, after which
+ * operations recorded by other threads are rejected until it is released,
+ * see DeviceQueue. */
+class Session {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static Session& instance() {
+        static Session session;
+        return session;
+    }
+
+    ~Session() { end(); }
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    /* Start recording an operation that runs `kernel`. */
+    void begin(const std::string& kernel) {
+        checkThread_();
+        requestedKernel_ = kernel;
+        requests_.clear();
+        messages_.clear();
+        retained_.clear();
+        staged_.clear();
+        tagSize_ = 0;
+    }
+
+    /* The source has to stay valid until run(). If the same non-zero
+     * `contentKey` was given for the stream in the previous operation, the
+     * data in external memory is assumed to be up to date. */
+    void createDownStream(const void* source, unsigned int pid, int totalSize,
+                          int chunkSize, std::uint64_t contentKey = 0) {
+        requests_.push_back({stream_kind::down, pid, source, totalSize,
+                             chunkSize, contentKey, nullptr});
+    }
+
+    /* A stream of chunks that are each preceded by their size, if the total
+     * size is not given the stream can not be reused. */
+    void createDownStreamRaw(const void* source, unsigned int pid,
+                             int totalSize, int maxChunkSize,
+                             std::uint64_t contentKey = 0) {
+        requests_.push_back({stream_kind::down_raw, pid, source, totalSize,
+                             maxChunkSize, contentKey, nullptr});
+    }
+
+    /* The address of the stream in external memory is passed to `bind`
+     * during run(), and stays valid until the next operation runs. */
+    void createUpStream(unsigned int pid, int totalSize, int chunkSize,
+                        std::function<void(void*)> bind) {
+        requests_.push_back({stream_kind::up, pid, nullptr, totalSize,
+                             chunkSize, 0, std::move(bind)});
+    }
+
+    /* A content key that has not been handed out before. */
+    static std::uint64_t uniqueKey() {
+        static std::atomic<std::uint64_t> next(1);
+        return next++;
+    }
+
+    /* Scratch memory for the source of a stream, owned by the session until
+     * the next operation is recorded. */
+    void* stage(std::size_t nbytes) {
+        staged_.emplace_back(nbytes);
+        return staged_.back().data();
+    }
+
+    void setTagSize(int tagSize) { tagSize_ = tagSize; }
+
+    void sendDown(unsigned int pid, int tag, const void* payload,
+                  int nbytes) {
+        Message message = {pid, tag, std::vector<char>(nbytes)};
+        std::memcpy(message.payload.data(), payload, nbytes);
+        messages_.push_back(std::move(message));
+    }
+
+    /* Run the recorded operation on the device. */
+    void run() {
+        // the memory of the previous operation is about to be reused
+        region_.reclaim();
+
+        if (!running_ || requestedKernel_ != kernel_ || !reusable_()) {
+            restart_();
+        } else {
+            reuseStreams_();
+        }
+
+        int tagSize = tagSize_;
+        ebsp_set_tagsize(&tagSize);
+        for (auto& message : messages_) {
+            ebsp_send_down(message.pid, &message.tag, message.payload.data(),
+                           message.payload.size());
+        }
+
+        auto start = clock::now();
+        ebsp_spmd();
+        statistics_.runSeconds += seconds_(start);
+        statistics_.runs++;
+    }
+
+    void end() {
+        if (!running_)
+            return;
+        checkThread_();
+
+        region_.reclaim();
+        bsp_end();
+        running_ = false;
+        kernel_.clear();
+        streams_.clear();
+    }
+
+    bool isRunning() const { return running_; }
+
+    /* Only `thread` may use the session until it is released. */
+    void reserve(std::thread::id thread) { reserved_ = thread; }
+    void release() { reserved_ = std::thread::id(); }
+    bool isReserved() const { return reserved_ != std::thread::id(); }
+
+    /* The external memory of the current system. */
+    ExternalRegion& region() { return region_; }
+
+    const SessionStatistics& getStatistics() const { return statistics_; }
+    void resetStatistics() { statistics_ = SessionStatistics(); }
+
+  private:
+    enum class stream_kind { down, down_raw, up };
+
+    struct StreamRequest {
+        stream_kind kind;
+        unsigned int pid;
+        const void* source;
+        int totalSize;
+        int chunkSize;
+        std::uint64_t contentKey;
+        std::function<void(void*)> bind;
+    };
+
+    struct StreamSlot {
+        stream_kind kind;
+        unsigned int pid;
+        int totalSize;
+        int chunkSize;
+        void* external;
+        std::uint64_t contentKey;
+    };
+
+    struct Message {
+        unsigned int pid;
+        int tag;
+        std::vector<char> payload;
+    };
+
+    Session() = default;
+
+    void checkThread_() const {
+        std::thread::id reserved = reserved_;
+        ZeeAssertMsg(reserved == std::thread::id() ||
+                         reserved == std::this_thread::get_id(),
+                     "The session is reserved by another thread, submit the "
+                     "operation to the device queue instead");
+        (void)reserved;
+    }
+
+    static double seconds_(clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    // Stream ids are given out in order of creation per processor, so the
+    // streams can only be reused if they come in the same order and shapes
+    bool reusable_() const {
+        if (requests_.size() != streams_.size())
+            return false;
+
+        for (std::size_t i = 0; i < requests_.size(); ++i) {
+            const auto& request = requests_[i];
+            const auto& slot = streams_[i];
+            if (request.kind != slot.kind || request.pid != slot.pid ||
+                request.totalSize != slot.totalSize ||
+                request.chunkSize != slot.chunkSize || request.totalSize == 0)
+                return false;
+        }
+        return true;
+    }
+
+    void reuseStreams_() {
+        auto start = clock::now();
+        for (std::size_t i = 0; i < requests_.size(); ++i) {
+            auto& request = requests_[i];
+            auto& slot = streams_[i];
+            if (request.kind == stream_kind::up) {
+                request.bind(slot.external);
+            } else if (request.contentKey != 0 &&
+                       request.contentKey == slot.contentKey) {
+                statistics_.streamsUnchanged++;
+            } else {
+                std::memcpy(slot.external, request.source, request.totalSize);
+                slot.contentKey = request.contentKey;
+            }
+            statistics_.streamsReused++;
+        }
+        statistics_.streamSeconds += seconds_(start);
+    }
+
+    // A down stream can be created from the results of a previous operation,
+    // which live in the external memory that is freed by bsp_end
+    void retainSources_() {
+        retained_.clear();
+        for (auto& request : requests_) {
+            if (request.kind == stream_kind::up || request.totalSize == 0)
+                continue;
+
+            auto source = (const char*)request.source;
+            for (const auto& slot : streams_) {
+                auto external = (const char*)slot.external;
+                if (source >= external &&
+                    source < external + slot.totalSize) {
+                    retained_.emplace_back(source,
+                                           source + request.totalSize);
+                    request.source = retained_.back().data();
+                    break;
+                }
+            }
+        }
+    }
+
+    void restart_() {
+        if (running_) {
+            retainSources_();
+            bsp_end();
+            running_ = false;
+        }
+
+        auto start = clock::now();
+        int loaded = bsp_init(requestedKernel_.c_str(), 0, 0);
+        ZeeAssertMsg(loaded, "The kernel could not be loaded");
+        int started = bsp_begin(stream_config::processors);
+        ZeeAssertMsg(started, "The cores could not be started");
+        (void)loaded;
+        (void)started;
+        kernel_ = requestedKernel_;
+        running_ = true;
+        statistics_.initSeconds += seconds_(start);
+        statistics_.initializations++;
+
+        start = clock::now();
+        streams_.clear();
+        for (auto& request : requests_) {
+            void* external = nullptr;
+            switch (request.kind) {
+            case stream_kind::down:
+                external = ebsp_create_down_stream(
+                    request.source, request.pid, request.totalSize,
+                    request.chunkSize);
+                break;
+            case stream_kind::down_raw:
+                external = ebsp_create_down_stream_raw(
+                    request.source, request.pid, request.totalSize,
+                    request.chunkSize);
+                break;
+            case stream_kind::up:
+                external = ebsp_create_up_stream(
+                    request.pid, request.totalSize, request.chunkSize);
+                request.bind(external);
+                break;
+            }
+            streams_.push_back({request.kind, request.pid, request.totalSize,
+                                request.chunkSize, external,
+                                request.contentKey});
+            statistics_.streamsCreated++;
+        }
+        statistics_.streamSeconds += seconds_(start);
+    }
+
+    // the operation that is being recorded
+    std::string requestedKernel_;
+    std::vector<StreamRequest> requests_;
+    std::vector<Message> messages_;
+    std::vector<std::vector<char>> staged_;
+    std::vector<std::vector<char>> retained_;
+    int tagSize_ = 0;
+
+    // the state of the system
+    std::string kernel_;
+    std::vector<StreamSlot> streams_;
+    bool running_ = false;
+
+    ExternalRegion region_;
+    SessionStatistics statistics_;
+    std::atomic<std::thread::id> reserved_{std::thread::id()};
+};
+
+} // namespace Zephany
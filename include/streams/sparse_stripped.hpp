@@ -1,110 +1,177 @@
 #pragma once
 
 // TODO:
-// [ ] 'raw' stream with variable chunk sizeInBytes
-//   [ ] include header sizes
-//   [ ] write header sizes
-//   [ ] check create_down_stream_raw
-// [ ] check if indices get constructed correctly
-// [ ] create up stream
-// [ ] gather partial results of u_j with correct indices
-// [ ] to avoid copies maybe we move v into a separate stream
-// [ ] what about upStream? also create
-// [ ] values of v are not at all important, so maybe ignore these
+// [x] 'raw' stream with variable chunk sizeInBytes
+//   [x] include header sizes
+//   [x] write header sizes
+//   [x] check create_down_stream_raw
+// [x] check if indices get constructed correctly
+// [x] create up stream
+// [x] gather partial results of u_j with correct indices
+// [x] to avoid copies maybe we move v into a separate stream
+// [x] what about upStream? also create
+// [x] values of v are not at all important, so maybe ignore these
 //     and write them only at spmv
 
 #include <host_bsp.h>
 #include "streams.hpp"
 #include "stdint.h"
 #include "../matrix/sparse.hpp"
+#include "../util/cache.hpp"
+#include "../util/thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <tuple>
 
 namespace Zephany {
 
+// The nonzeros of a window are stored as triplets, or in compressed row
+// storage over the local rows of the window
+enum class window_layout { triplets, csr };
+
+/* Writes the chunks of a raw stream, in which every chunk is preceded by its
+ * size in bytes (see ebsp_create_down_stream_raw). */
+class RawStreamWriter {
+  public:
+    void reserve(std::size_t bytes) { data_.reserve(bytes); }
+
+    void beginChunk() {
+        chunkStart_ = data_.size();
+        push<int>(0);
+    }
+
+    void endChunk() {
+        int size = (int)(data_.size() - chunkStart_ - sizeof(int));
+        std::memcpy(&data_[chunkStart_], &size, sizeof(int));
+        maxChunkSize_ = std::max(maxChunkSize_, size);
+    }
+
+    template <typename T>
+    void push(T value) {
+        push(&value, 1);
+    }
+
+    template <typename T>
+    void push(const T* values, std::size_t count) {
+        auto offset = data_.size();
+        data_.resize(offset + count * sizeof(T));
+        if (count > 0)
+            std::memcpy(&data_[offset], values, count * sizeof(T));
+    }
+
+    /* Overwrite values that were written before, e.g. a header that is only
+     * known once the rest of the stream has been written. */
+    template <typename T>
+    void set(std::size_t offset, const T* values, std::size_t count) {
+        std::memcpy(&data_[offset], values, count * sizeof(T));
+    }
+
+    std::vector<char>& data() { return data_; }
+    int maxChunkSize() const { return maxChunkSize_; }
+
+  private:
+    std::vector<char> data_;
+    std::size_t chunkStart_ = 0;
+    int maxChunkSize_ = 0;
+};
+
 template <typename TIdx>
 struct SparseStreamHeader {
-    TIdx maxSizeU;
-    TIdx maxSizeV;
-    TIdx maxWindowSize;
-    TIdx maxNonLocal;
-    TIdx numStrips;
-
-    void write(void** address) const {
-        // I think struct is guarenteed to be C-compatible such that
-        // we could just copy *this here.
-        TIdx* ptr = (TIdx*)*address;
-        ptr[0] = maxSizeU;
-        ptr[1] = maxSizeV;
-        ptr[2] = maxWindowSize;
-        ptr[3] = maxNonLocal;
-        ptr[4] = numStrips;
-        address += this->sizeInBytes();
-    }
-
-    constexpr unsigned int sizeInBytes() const { return sizeof(TIdx) * 5; }
-};
+    TIdx maxSizeU = 0;
+    TIdx maxSizeV = 0;
+    TIdx maxWindowSize = 0;
+    TIdx maxNonLocal = 0;
+    TIdx numStrips = 0;
+    // the size of the local row and column indices in the windows, 2 or 4
+    TIdx indexBytes = sizeof(TIdx);
+    // the window_layout, 0 for triplets and 1 for CSR
+    TIdx layout = 0;
+
+    // the header is the first chunk of a stream
+    void write(RawStreamWriter& writer) const {
+        writer.beginChunk();
+        writer.push(values().data(), values().size());
+        writer.endChunk();
+    }
 
-template <typename TVal, typename TIdx>
-struct SparseStreamStripHeader {
-    TIdx numWindows;
-    std::vector<TVal> v;
-
-    void write(void** address) const {
-        // write to address and add to address pointer
-        TIdx* ptr = (TIdx*)*address;
-        TIdx i = 0;
-        ptr[i++] = numWindows;
-        ptr[i++] = (TIdx)v.size();
-        TVal* valPtr = (TVal*)&ptr[i];
-        i = 0;
-        for (auto val : v) {
-            valPtr[i++] = val;
-        }
-        address += this->sizeInBytes();
+    void update(RawStreamWriter& writer) const {
+        writer.set(sizeof(int), values().data(), values().size());
     }
 
-    unsigned int sizeInBytes() const {
-        return sizeof(TIdx) * 2 + sizeof(TVal) * v.size();
+    /* Read and overwrite the header at the start of a raw stream. */
+    static SparseStreamHeader read(const char* stream) {
+        std::array<TIdx, 7> fields;
+        std::memcpy(fields.data(), stream + sizeof(int), sizeof(fields));
+        SparseStreamHeader header;
+        header.maxSizeU = fields[0];
+        header.maxSizeV = fields[1];
+        header.maxWindowSize = fields[2];
+        header.maxNonLocal = fields[3];
+        header.numStrips = fields[4];
+        header.indexBytes = fields[5];
+        header.layout = fields[6];
+        return header;
     }
-};
 
-template <typename TVal, typename TIdx>
-struct SparseStreamWindow {
-    std::vector<TIdx> nonLocalOwners;
-    std::vector<TIdx> nonLocalIndices;
-
-    std::vector<Triplet<TVal, TIdx>> triplets;
-    TIdx sizeU;
-
-    void write(void** address) const {
-        // write to address and add to address pointer
-        TIdx* ptr = (TIdx*)*address;
-        TIdx i = 0;
-        ptr[i++] = (TIdx)nonLocalOwners.size();
-        for (auto owner : nonLocalOwners)
-            ptr[i++] = owner;
-
-        for (auto indices : nonLocalIndices)
-            ptr[i++] = indices;
-        ptr[i++] = sizeU;
-        ptr[i++] = (TIdx)triplets.size();
-        for (auto& triplet : triplets)
-            ptr[i++] = triplet.row();
-        for (auto& triplet : triplets)
-            ptr[i++] = triplet.col();
-        TVal* valPtr = (TVal*)&ptr[i];
-        i = 0;
-        for (auto& triplet : triplets)
-            valPtr[i++] = triplet.value();
-        address += this->sizeInBytes();
+    void store(char* stream) const {
+        std::memcpy(stream + sizeof(int), values().data(),
+                    sizeof(TIdx) * values().size());
     }
 
-    unsigned int sizeInBytes() const {
-        return sizeof(TIdx) *
-                   (2 * triplets.size() + 2 * nonLocalOwners.size() + 1) +
-               sizeof(TVal) * triplets.size();
+    std::array<TIdx, 7> values() const {
+        return {maxSizeU, maxSizeV,  maxWindowSize, maxNonLocal,
+                numStrips, indexBytes, layout};
     }
 };
 
+/* The stream of a processor consists of the following chunks:
+ *
+ * - the header, see SparseStreamHeader
+ * - for every strip, a strip header
+ *     [numWindows, numLocalV, fetch, numRuns, windowIds[numWindows],
+ *      owners[numRuns], starts[numRuns], lengths[numRuns]]
+ * - followed by the windows of the strip that have nonzeros on the
+ *   processor, windowIds holds their indices
+ *     [sizeU, windowSize, rows[windowSize], cols[windowSize],
+ *      values[windowSize]]
+ *   The nonzeros are sorted by row. In the CSR layout rows[sizeU + 1] holds
+ *   the start of every local row instead of the row of every nonzero. The
+ *   local rows and columns take indexBytes each, when these are two bytes
+ *   the values start at the next multiple of four bytes.
+ *   Column j of a triplet refers to v[j] if j < numLocalV, and to the
+ *   (j - numLocalV)th non-local component of the strip otherwise. Rows
+ *   are local to the window, see getUpIndices().
+ *
+ * The non-local components that the windows of a strip need are fetched
+ * once, when the strip begins. They are fetched in runs, run r holds the
+ * components starts[r], ..., starts[r] + lengths[r] - 1 of the strip of
+ * processor owners[r].
+ *
+ * The vector is not part of this stream, so that the stream can be reused
+ * for many products. A second stream holds a chunk for every strip, with
+ * the numLocalV components of v in that strip that are owned by the
+ * processor, in increasing order of column. It is filled by updateVector().
+ * When k vectors are multiplied at once, see updateVectors(), the chunk
+ * holds k components for every column, and local index j refers to
+ * components j * k, ..., j * k + k - 1. The windows are then streamed once
+ * for all vectors, and the up stream holds k partial sums for every row.
+ *
+ * Within a strip the processors only read the components of v of other
+ * processors, so they only synchronise at strips where fetch is set, which
+ * is the same for every processor. The maxima maxSizeV and maxNonLocal in
+ * the header are taken over all processors, so that the components of v
+ * have the same location on every processor.
+ *
+ * The stream is built using counting sorts and dense index tables, so that
+ * the time and memory that are needed are linear in the number of nonzeros,
+ * rows, columns and windows. */
 template <typename TMatrix, typename TVector>
 class SparseStream
     : Stream<typename TMatrix::value_type, typename TMatrix::index_type> {
@@ -116,21 +183,51 @@ class SparseStream
         : Stream<TVal, TIdx>(stream_direction::down), A_(A), v_(v),
           stripSize_(stripSize), windowSize_(windowSize) {}
 
-    ~SparseStream() {
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            operator delete(sparseData_[s]);
-        }
+    ~SparseStream() { A_.releaseStream(this); }
+
+    SparseStream(const SparseStream&) = delete;
+    SparseStream& operator=(const SparseStream&) = delete;
+
+    /* Store the local indices of the windows in 16 bits when the strips and
+     * windows are small enough, which is the default. */
+    void setCompactIndices(bool compact) { compactIndices_ = compact; }
+
+    /* Store the nonzeros of the windows as triplets, the default, or in
+     * CSR format. */
+    void setLayout(window_layout layout) { layout_ = layout; }
+    window_layout getLayout() const { return layout_; }
+
+    /* The size in bytes of the local indices in the windows. */
+    TIdx localIndexBytes() const {
+        const std::size_t limit = std::numeric_limits<uint16_t>::max();
+        if (!compactIndices_ || stripSize_ > limit || windowSize_ > limit)
+            return sizeof(TIdx);
+        // the row pointers go up to the number of nonzeros in a window
+        if (layout_ == window_layout::csr &&
+            (std::size_t)stripSize_ * windowSize_ > limit)
+            return sizeof(TIdx);
+        return sizeof(uint16_t);
     }
 
     void create() const override {
+        auto& session = Session::instance();
+        for (TIdx s = 0; s < stream_config::processors; s++) {
+            session.createDownStreamRaw((const void*)streamData_[s], s,
+                                        (int)streamSizes_[s],
+                                        maxChunkSizes_[s], streamKey_);
+        }
         for (TIdx s = 0; s < stream_config::processors; s++) {
-            ebsp_create_down_stream_raw((const void*)(this->sparseData_[s]), s,
-                                        0,  // total size FIXME
-                                        0); // max chunk size (needed?) FIXME
+            session.createDownStreamRaw(
+                (const void*)vectorData_[s].data(), s,
+                (int)vectorData_[s].size(), vectorMaxChunkSizes_[s]);
         }
     }
 
-    void prepareStream() {
+    void prepareStream() { prepareStream(hostThreadPool()); }
+
+    /* Prepare the stream with the threads of `pool`, the stream does not
+     * depend on the number of threads. */
+    void prepareStream(ThreadPool& pool) {
         ZeeLogDebug << "SparseStream::prepareStream()" << endLog;
 
         ZeeAssert(A_.getRows() > windowSize_ && A_.getCols() > stripSize_);
@@ -145,221 +242,768 @@ class SparseStream
 
         // TODO: "windows" and "strips" should be constructed in some
         // partitioner, stored in matrix itself?
-        TIdx strips = (A_.getCols() - 1) / stripSize_ + 1;
-        TIdx windows = (A_.getRows() - 1) / windowSize_ + 1;
+        strips_ = (A_.getCols() - 1) / stripSize_ + 1;
+        windows_ = (A_.getRows() - 1) / windowSize_ + 1;
+
+        // the index of every column among the columns of its strip that are
+        // owned by the same processor
+        auto& owners = v_.getOwners();
+        std::vector<TIdx> stripLocalIndices(A_.getCols());
+        pool.parallelFor(strips_, [&](TIdx strip) {
+            std::array<TIdx, stream_config::processors> next = {};
+            for (TIdx column = strip * stripSize_;
+                 column < A_.getCols() && column < (strip + 1) * stripSize_;
+                 ++column) {
+                stripLocalIndices[column] = next[owners[column]]++;
+            }
+        });
+
+        // the streams of the processors are independent, and every stream
+        // is built by a single thread so that its bytes do not depend on the
+        // number of threads
+        // whether some processor needs components of v that are owned by
+        // another processor in a strip
+        const auto& images = A_.getImages();
+        std::vector<std::vector<char>> fetches(stream_config::processors);
+        pool.parallelFor(stream_config::processors, [&](TIdx s) {
+            fetches[s].assign(strips_, 0);
+            for (const auto& triplet : *images[s])
+                if (owners[triplet.col()] != s)
+                    fetches[s][triplet.col() / stripSize_] = 1;
+        });
+        std::vector<char> stripFetches(strips_, 0);
+        for (const auto& processorFetches : fetches)
+            for (TIdx strip = 0; strip < strips_; ++strip)
+                stripFetches[strip] |= processorFetches[strip];
+
+        vectorCount_ = 1;
+        pool.parallelFor(stream_config::processors, [&](TIdx s) {
+            prepareProcessor_(s, *images[s], stripLocalIndices,
+                              stripFetches);
+            prepareVector_(s);
+        });
+        shareMaxima_();
+        streamKey_ = Session::uniqueKey();
+        A_.setStream(this);
+
+        for (TIdx s = 0; s < stream_config::processors; ++s)
+            ZeeLogVar(streamSizes_[s]);
+
+        ZeeLogDebug << "Finished constructing stream" << endLog;
+    }
 
-        std::array<std::vector<SparseStreamWindow<TVal, TIdx>>,
-                   stream_config::processors> windowChunks;
+    TIdx upStreamSize(TIdx proc) const {
+        return upStreamSize_[proc];
+    }
 
-        std::array<std::vector<std::set<TIdx>>, stream_config::processors>
-            windowRowset;
+    TIdx upStreamChunkSize(TIdx proc) const {
+        return upStreamChunkSize_[proc];
+    }
 
-        std::array<std::vector<std::set<TIdx>>, stream_config::processors>
-            windowColset;
+    /* The number of local rows of every window of a processor, the rows of
+     * a window are consecutive in getUpIndices(). */
+    const std::array<std::vector<TIdx>, stream_config::processors>&
+    getWindowSizeU() const {
+        return windowSizeU_;
+    }
 
+    /* The global row of every component in the up stream of a processor,
+     * i.e. the rows of all windows in the order of the stream. Local row i
+     * of a window refers to the ith row of the window in this array. */
+    const std::array<std::vector<TIdx>, stream_config::processors>&
+    getUpIndices() const {
+        return upIndices_;
+    }
+
+    struct FetchStatistics {
+        std::size_t components = 0;
+        std::size_t runs = 0;
+
+        double averageRunLength() const {
+            return runs == 0 ? 0.0 : (double)components / runs;
+        }
+    };
+
+    /* The number of non-local components that are fetched by processor s,
+     * and the number of runs in which they are fetched. */
+    FetchStatistics getFetchStatistics(TIdx s) const {
+        FetchStatistics statistics;
+        const char* data = streamData_[s];
+        std::size_t offset = 0;
+        auto nextChunk = [&]() {
+            int size = 0;
+            std::memcpy(&size, data + offset, sizeof(int));
+            const char* chunk = data + offset + sizeof(int);
+            offset += sizeof(int) + size;
+            return chunk;
+        };
+        auto word = [](const char* chunk, std::size_t i) {
+            TIdx value = 0;
+            std::memcpy(&value, chunk + i * sizeof(TIdx), sizeof(TIdx));
+            return value;
+        };
+
+        nextChunk();
+        for (TIdx strip = 0; strip < strips_; ++strip) {
+            const char* stripHeader = nextChunk();
+            const TIdx windows = word(stripHeader, 0);
+            const TIdx runs = word(stripHeader, 3);
+            const std::size_t lengths = 4 + windows + 2 * runs;
+            statistics.runs += runs;
+            for (TIdx r = 0; r < runs; ++r)
+                statistics.components += word(stripHeader, lengths + r);
+            for (TIdx w = 0; w < windows; ++w)
+                nextChunk();
+        }
+        return statistics;
+    }
+
+    /* The same, summed over all processors. */
+    FetchStatistics getFetchStatistics() const {
+        FetchStatistics statistics;
         for (TIdx s = 0; s < stream_config::processors; ++s) {
-            windowChunks[s].resize(strips * windows);
-            windowRowset[s].resize(strips * windows);
-            windowColset[s].resize(strips * windows);
+            auto local = getFetchStatistics(s);
+            statistics.components += local.components;
+            statistics.runs += local.runs;
+        }
+        return statistics;
+    }
+
+    /* The header of the stream of processor s. */
+    SparseStreamHeader<TIdx> getHeader(TIdx s) const {
+        return SparseStreamHeader<TIdx>::read(streamData_[s]);
+    }
+
+    /* The bytes of local memory that k_spmv needs on processor s when it
+     * multiplies `vectors` vectors at once: two buffers for every stream,
+     * and two buffers for the components of v in a strip. */
+    std::size_t localMemory(TIdx s, TIdx vectors = 1) const {
+        auto header = getHeader(s);
+        const std::size_t vectorChunk =
+            (std::size_t)vectorMaxChunkSizes_[s] / vectorCount_ * vectors;
+        const std::size_t upChunk =
+            std::max<std::size_t>(upStreamChunkSize_[s], sizeof(TVal)) *
+            vectors;
+        return 2 * (std::size_t)maxChunkSizes_[s] + 2 * vectorChunk +
+               2 * upChunk +
+               2 * ((std::size_t)header.maxSizeV + header.maxNonLocal) *
+                   vectors * sizeof(TVal);
+    }
+
+    /* Write the components of x to the vector streams, x has to be
+     * distributed like the vector that the stream was prepared for. */
+    void updateVector(const TVector& x) {
+        ZeeAssertMsg(x.getOwners() == v_.getOwners(),
+                     "The vector is not distributed like the stream");
+        writeVectors_(1, [&](TIdx, TIdx column) { return x[column]; });
+    }
+
+    /* Write the components of a block of vectors, that are multiplied by
+     * the matrix at once. The components of the vectors in a column follow
+     * each other in the chunk of a strip. */
+    void updateVectors(const std::vector<TVector>& X) {
+        ZeeAssert(!X.empty());
+        for (const auto& x : X) {
+            ZeeAssertMsg(x.getOwners() == v_.getOwners(),
+                         "The vectors are not distributed like the stream");
+            (void)x;
         }
+        writeVectors_((TIdx)X.size(),
+                      [&](TIdx j, TIdx column) { return X[j][column]; });
+    }
+
+    /* The number of vectors in the vector streams. */
+    TIdx getVectorCount() const { return vectorCount_; }
+
+    /* The vector that the stream was prepared for. */
+    const TVector& getVector() const { return v_; }
+
+    /* The raw vector stream of processor s. */
+    const std::vector<char>& getVectorStream(TIdx s) const {
+        return vectorData_[s];
+    }
 
-        TIdx s = 0;
+    /* The raw stream of processor s, including the chunk sizes. */
+    const char* getRawStream(TIdx s) const { return streamData_[s]; }
+    std::size_t getRawStreamSize(TIdx s) const { return streamSizes_[s]; }
+
+    /* Identifies the stream, it depends on the nonzeros and their
+     * distribution, the distribution of the vector, and the strip and
+     * window sizes. */
+    std::uint64_t cacheKey() const {
+        Hasher hasher;
+        hasher.add((std::uint32_t)cache_version);
+        hasher.add(stream_config::processors);
+        hasher.add(A_.getRows());
+        hasher.add(A_.getCols());
+        hasher.add(stripSize_);
+        hasher.add(windowSize_);
+        hasher.add(localIndexBytes());
+        hasher.add((std::uint32_t)layout_);
         for (const auto& image : A_.getImages()) {
-            for (auto triplet : *image) {
-                // compute block number of triplet
-                auto strip = triplet.col() / stripSize_;
-                auto window = triplet.row() / windowSize_;
-                auto windowIdx = strip * windows + window;
-
-                windowChunks[s][windowIdx].triplets.push_back(triplet);
-                windowRowset[s][windowIdx].insert(triplet.row());
-                windowColset[s][windowIdx].insert(triplet.col());
+            hasher.add(image->nonZeros());
+            for (const auto& triplet : *image) {
+                hasher.add(triplet.row());
+                hasher.add(triplet.col());
+                hasher.add(triplet.value());
             }
-            ++s;
         }
+        for (auto owner : v_.getOwners())
+            hasher.add(owner);
+        return hasher.value();
+    }
+
+    /* Use the stream in the cache in `directory` if it has been prepared
+     * before, otherwise prepare it and add it to the cache. */
+    void prepareStream(const std::string& directory) {
+        auto key = cacheKey();
+        char name[32];
+        snprintf(name, sizeof(name), "sparse_%016llx.bin",
+                 (unsigned long long)key);
+        std::string path = directory + "/" + name;
+
+        if (load_(path, key)) {
+            ZeeLogDebug << "Loaded stream from " << path << endLog;
+            return;
+        }
+
+        prepareStream();
+        if (!save_(path, key))
+            ZeeLogWarning << "Could not write stream cache " << path << endLog;
+    }
 
-        std::array<std::vector<SparseStreamStripHeader<TVal, TIdx>>,
-                   stream_config::processors> stripHeaders;
-        std::array<std::vector<std::vector<TIdx>>, stream_config::processors>
-            stripIndicesV;
+    /* Write the prepared stream to a file, which can be loaded by any
+     * stream with the same cacheKey(). */
+    bool save(const std::string& path) const {
+        return save_(path, cacheKey());
+    }
+
+    /* Load a stream that was saved by save(), the file is mapped into
+     * memory and used as the source of the stream. Returns false if the
+     * file does not exist, or does not belong to this stream. */
+    bool load(const std::string& path) { return load_(path, cacheKey()); }
+
+  private:
+    static constexpr std::uint32_t cache_version = 7;
+    static constexpr const char* cache_magic = "ZPHSTRM";
+
+    struct CacheHeader {
+        char magic[8];
+        std::uint64_t key;
+        std::uint32_t processors;
+        std::uint32_t strips;
+        std::uint32_t windows;
+        std::uint32_t indexBytes;
+    };
+
+    struct CacheProcessor {
+        std::uint64_t indexOffset;
+        std::uint64_t streamOffset;
+        std::uint64_t streamSize;
+        std::int32_t maxChunkSize;
+        std::uint32_t upStreamSize;
+        std::uint32_t upStreamChunkSize;
+        std::uint32_t padding;
+    };
+
+    static std::uint64_t align_(std::uint64_t offset) {
+        return (offset + 7) & ~(std::uint64_t)7;
+    }
 
+    // the key is computed by the caller, hashing the matrix is not free
+    bool save_(const std::string& path, std::uint64_t key) const {
+        const std::size_t windowCount = (std::size_t)strips_ * windows_;
+
+        CacheHeader header = {};
+        std::memcpy(header.magic, cache_magic, sizeof(header.magic));
+        header.key = key;
+        header.processors = stream_config::processors;
+        header.strips = strips_;
+        header.windows = windows_;
+        header.indexBytes = sizeof(TIdx);
+
+        std::array<CacheProcessor, stream_config::processors> entries;
+        std::uint64_t offset =
+            sizeof(CacheHeader) + sizeof(CacheProcessor) * entries.size();
         for (TIdx s = 0; s < stream_config::processors; ++s) {
-            stripHeaders[s].resize(strips);
-            stripIndicesV[s].resize(strips);
-            for (TIdx strip = 0; strip < strips; ++strip) {
-                stripHeaders[s][strip].numWindows = windows;
+            std::uint64_t indices = windowCount;
+            for (auto sizeU : windowSizeU_[s])
+                indices += sizeU;
+
+            auto& entry = entries[s];
+            entry.indexOffset = offset;
+            offset = align_(offset + indices * sizeof(TIdx));
+            entry.streamOffset = offset;
+            entry.streamSize = streamSizes_[s];
+            offset = align_(offset + streamSizes_[s]);
+            entry.maxChunkSize = maxChunkSizes_[s];
+            entry.upStreamSize = upStreamSize_[s];
+            entry.upStreamChunkSize = upStreamChunkSize_[s];
+        }
+
+        // the file is only put in place once it is complete
+        std::string partial = path + ".partial";
+        {
+            std::ofstream file(partial, std::ios::binary);
+            if (!file)
+                return false;
+
+            auto position = [&]() { return (std::uint64_t)file.tellp(); };
+            auto pad = [&](std::uint64_t target) {
+                while (position() < target)
+                    file.put(0);
+            };
+
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)entries.data(),
+                       sizeof(CacheProcessor) * entries.size());
+            for (TIdx s = 0; s < stream_config::processors; ++s) {
+                pad(entries[s].indexOffset);
+                file.write((const char*)windowSizeU_[s].data(),
+                           windowCount * sizeof(TIdx));
+                file.write((const char*)upIndices_[s].data(),
+                           upIndices_[s].size() * sizeof(TIdx));
+                pad(entries[s].streamOffset);
+                file.write(streamData_[s], streamSizes_[s]);
             }
+
+            if (!file)
+                return false;
         }
 
-        auto& owners = v_.getOwners();
-        ZeeLogVar(owners);
+        return std::rename(partial.c_str(), path.c_str()) == 0;
+    }
+
+    bool load_(const std::string& path, std::uint64_t key) {
+        auto mapped = std::make_shared<MappedFile>(path);
+        if (!mapped->isOpen())
+            return false;
+
+        const char* data = mapped->data();
+        const std::size_t size = mapped->size();
+        std::size_t tableEnd = sizeof(CacheHeader) +
+                               sizeof(CacheProcessor) * stream_config::processors;
+        if (size < tableEnd)
+            return false;
+
+        CacheHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        TIdx strips = (A_.getCols() - 1) / stripSize_ + 1;
+        TIdx windows = (A_.getRows() - 1) / windowSize_ + 1;
+        if (std::memcmp(header.magic, cache_magic, sizeof(header.magic)) !=
+                0 ||
+            header.key != key ||
+            header.processors != stream_config::processors ||
+            header.strips != strips || header.windows != windows ||
+            header.indexBytes != sizeof(TIdx))
+            return false;
+
+        const std::size_t windowCount = (std::size_t)strips * windows;
+        std::array<CacheProcessor, stream_config::processors> entries;
+        std::memcpy(entries.data(), data + sizeof(CacheHeader),
+                    sizeof(CacheProcessor) * entries.size());
+        for (auto& entry : entries) {
+            if (entry.streamOffset + entry.streamSize > size ||
+                entry.indexOffset + windowCount * sizeof(TIdx) >
+                    entry.streamOffset)
+                return false;
+
+            auto sizes = (const TIdx*)(data + entry.indexOffset);
+            std::uint64_t indices = windowCount;
+            for (std::size_t w = 0; w < windowCount; ++w)
+                indices += sizes[w];
+            if (entry.indexOffset + indices * sizeof(TIdx) >
+                entry.streamOffset)
+                return false;
+        }
 
-        // for each strip need local V
-        for (TIdx strip = 0; strip < strips; ++strip) {
-            // local V and values
+        strips_ = strips;
+        windows_ = windows;
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            auto& entry = entries[s];
+            auto indices = (const TIdx*)(data + entry.indexOffset);
+            windowSizeU_[s].assign(indices, indices + windowCount);
+            indices += windowCount;
+            upStreamSize_[s] = entry.upStreamSize;
+
+            // the rows of the windows are stored contiguously
+            std::size_t rows = 0;
+            for (auto sizeU : windowSizeU_[s])
+                rows += sizeU;
+            upIndices_[s].assign(indices, indices + rows);
+
+            upStreamChunkSize_[s] = entry.upStreamChunkSize;
+            maxChunkSizes_[s] = entry.maxChunkSize;
+            sparseData_[s].clear();
+            streamData_[s] = data + entry.streamOffset;
+            streamSizes_[s] = entry.streamSize;
+            prepareVector_(s);
+        }
+        vectorCount_ = 1;
+        mapped_ = mapped;
+        streamKey_ = Session::uniqueKey();
+        A_.setStream(this);
+
+        return true;
+    }
+
+    // The layout of the vector stream of processor s, a chunk for every strip
+    // with the components it owns. Empty strips get a chunk of a single
+    // component, since a chunk of size zero ends a raw stream.
+    void prepareVector_(TIdx s) {
+        auto& owners = v_.getOwners();
+        auto& indices = vectorIndices_[s];
+        auto& stripSizes = vectorStripSizes_[s];
+        indices.clear();
+        stripSizes.assign(strips_, 0);
+
+        RawStreamWriter writer;
+        for (TIdx strip = 0; strip < strips_; ++strip) {
+            writer.beginChunk();
             for (TIdx column = strip * stripSize_;
                  column < A_.getCols() && column < (strip + 1) * stripSize_;
                  ++column) {
-                stripHeaders[owners[column]][strip].v.push_back(v_[column]);
-                stripIndicesV[owners[column]][strip].push_back(column);
+                if (owners[column] == s) {
+                    indices.push_back(column);
+                    writer.push(v_[column]);
+                    stripSizes[strip]++;
+                }
             }
+            if (stripSizes[strip] == 0)
+                writer.push((TVal)0);
+            writer.endChunk();
         }
 
-        // now we have a list of windows and strips
-        // we now need:
-        std::array<SparseStreamHeader<TIdx>, stream_config::processors>
-            headers;
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            for (TIdx windowIdx = 0; windowIdx < strips * windows;
-                 ++windowIdx) {
-                TIdx sizeV = windowColset[s][windowIdx].size();
-                TIdx sizeU = windowRowset[s][windowIdx].size();
-                TIdx sizeWindow = windowChunks[s][windowIdx].triplets.size();
-                TIdx nonLocal =
-                    sizeV - stripIndicesV[s][windowIdx / windows].size();
-
-                windowChunks[s][windowIdx].nonLocalOwners.resize(nonLocal);
-                windowChunks[s][windowIdx].nonLocalIndices.resize(nonLocal);
-                windowChunks[s][windowIdx].sizeU = sizeU;
-                windowSizeU_[s][windowIdx] = sizeU;
-                upStreamSize_[s] += sizeU * sizeof(TIdx);
+        vectorData_[s] = std::move(writer.data());
+        vectorMaxChunkSizes_[s] = writer.maxChunkSize();
+    }
 
-                if (sizeV > headers[s].maxSizeV)
-                    headers[s].maxSizeV = sizeV;
-                if (sizeU > headers[s].maxSizeU) {
-                    headers[s].maxSizeU = sizeU;
-                    upStreamChunkSize_[s] = sizeU;
+    // Write the components of `vectors` vectors to the vector streams, the
+    // chunk of a strip holds `vectors` components for every column it owns.
+    // The streams are laid out again when the number of vectors changes.
+    template <typename TComponent>
+    void writeVectors_(TIdx vectors, TComponent component) {
+        if (vectors != vectorCount_) {
+            vectorCount_ = vectors;
+            for (TIdx s = 0; s < stream_config::processors; ++s) {
+                RawStreamWriter writer;
+                for (TIdx strip = 0; strip < strips_; ++strip) {
+                    std::vector<TVal> zeros(
+                        std::max<TIdx>(vectorStripSizes_[s][strip], 1) *
+                            vectors,
+                        (TVal)0);
+                    writer.beginChunk();
+                    writer.push(zeros.data(), zeros.size());
+                    writer.endChunk();
                 }
-                if (sizeWindow > headers[s].maxWindowSize)
-                    headers[s].maxWindowSize = sizeWindow;
-                if (nonLocal > headers[s].maxNonLocal)
-                    headers[s].maxNonLocal = nonLocal;
+                vectorData_[s] = std::move(writer.data());
+                vectorMaxChunkSizes_[s] = writer.maxChunkSize();
             }
         }
 
         for (TIdx s = 0; s < stream_config::processors; ++s) {
-            localToGlobalU_[s].resize(strips * windows);
+            auto& data = vectorData_[s];
+            std::size_t offset = 0;
+            std::size_t k = 0;
+            for (TIdx strip = 0; strip < strips_; ++strip) {
+                offset += sizeof(int);
+                for (TIdx i = 0; i < vectorStripSizes_[s][strip]; ++i) {
+                    const TIdx column = vectorIndices_[s][k++];
+                    for (TIdx j = 0; j < vectors; ++j) {
+                        TVal value = component(j, column);
+                        std::memcpy(
+                            &data[offset + (i * vectors + j) * sizeof(TVal)],
+                            &value, sizeof(TVal));
+                    }
+                }
+                int size = 0;
+                std::memcpy(&size, &data[offset - sizeof(int)], sizeof(int));
+                offset += size;
+            }
         }
+    }
 
+    // every processor uses the largest sizes of v of all processors
+    void shareMaxima_() {
+        SparseStreamHeader<TIdx> shared;
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            auto header = SparseStreamHeader<TIdx>::read(streamData_[s]);
+            shared.maxSizeV = std::max(shared.maxSizeV, header.maxSizeV);
+            shared.maxNonLocal =
+                std::max(shared.maxNonLocal, header.maxNonLocal);
+        }
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            auto header = SparseStreamHeader<TIdx>::read(streamData_[s]);
+            header.maxSizeV = shared.maxSizeV;
+            header.maxNonLocal = shared.maxNonLocal;
+            header.store(sparseData_[s].data());
+        }
+    }
 
-        // localize strip indices
-        std::array<std::map<TIdx, TIdx>, stream_config::processors>
-            stripLocalIndices;
+    template <typename TImage>
+    void prepareProcessor_(TIdx s, const TImage& image,
+                           const std::vector<TIdx>& stripLocalIndices,
+                           const std::vector<char>& stripFetches) {
+        const TIdx rows = A_.getRows();
+        const TIdx cols = A_.getCols();
+        const std::size_t windowCount = (std::size_t)strips_ * windows_;
+        auto& owners = v_.getOwners();
 
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            for (TIdx strip = 0; strip < strips; ++strip) {
-                // better to do this in one run.. here we localize the strip
-                // indices using a local map
-                for (TIdx i = 0; i < stripIndicesV[s][strip].size(); ++i) {
-                    stripLocalIndices[s][stripIndicesV[s][strip][i]] = i;
-                }
-            }
+        std::vector<Triplet<TVal, TIdx>> triplets(image.begin(), image.end());
+        const std::size_t nonZeros = triplets.size();
+
+        // sort the triplets by window, and by row within a window, using two
+        // passes of a stable counting sort
+        std::vector<std::size_t> byRow(nonZeros);
+        {
+            std::vector<std::size_t> offsets(rows + 1, 0);
+            for (auto& triplet : triplets)
+                offsets[triplet.row() + 1]++;
+            for (TIdx i = 0; i < rows; ++i)
+                offsets[i + 1] += offsets[i];
+            for (std::size_t k = 0; k < nonZeros; ++k)
+                byRow[offsets[triplets[k].row()]++] = k;
         }
 
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            for (TIdx strip = 0; strip < strips; ++strip) {
-                for (TIdx window = 0; window < windows; ++window) {
-                    std::map<TIdx, TIdx> windowLocalIndicesU;
-                    auto windowIdx = strip * windows + window;
-
-                    // NOTE: store mapping for u for every proc, otherwise we
-                    // cannot gather
-                    localToGlobalU_[s][windowIdx].resize(
-                        windowRowset.size());
-                    TIdx localIdx = 0;
-                    for (auto row : windowRowset[s][windowIdx]) {
-                        // localize U
-                        windowLocalIndicesU[row] = localIdx;
-                        localToGlobalU_[s][windowIdx][localIdx] =
-                            row;
-                        localIdx++;
-                    }
+        auto windowOf = [&](const Triplet<TVal, TIdx>& triplet) {
+            return (std::size_t)(triplet.col() / stripSize_) * windows_ +
+                   triplet.row() / windowSize_;
+        };
 
-                    // for each index we dont have, we need to set a local index
-                    // and obtain the remote index.. hardddd?! no
-                    // lets consider windowLocalIndices
-                    std::map<TIdx, TIdx> windowLocalIndicesV =
-                        stripLocalIndices[s]; // this is in a single strip
-                    TIdx nonLocalIdx = stripLocalIndices[s].size();
-                    for (auto col : windowColset[s][windowIdx]) {
-                        if (windowLocalIndicesV.find(col) != windowLocalIndicesV.end()) {
-                            windowLocalIndicesV[col] = nonLocalIdx++;
-                        }
-                        windowChunks[s][windowIdx].nonLocalOwners.push_back(owners[col]);
-                        windowChunks[s][windowIdx].nonLocalIndices.push_back(stripLocalIndices[owners[col]][col]);
-                    }
+        std::vector<std::size_t> order(nonZeros);
+        std::vector<std::size_t> windowStart(windowCount + 1, 0);
+        for (auto& triplet : triplets)
+            windowStart[windowOf(triplet) + 1]++;
+        for (std::size_t w = 0; w < windowCount; ++w)
+            windowStart[w + 1] += windowStart[w];
+        {
+            std::vector<std::size_t> offsets(windowStart.begin(),
+                                             windowStart.end() - 1);
+            for (auto k : byRow)
+                order[offsets[windowOf(triplets[k])]++] = k;
+        }
 
-                    // localize window indices. Note that some indices are nonlocal
-                    // here we need to find these and insert them in 'windowLocalIndices'
-                    for (auto& triplet :
-                         windowChunks[s][windowIdx].triplets) {
-                        triplet.setCol(windowLocalIndicesV[triplet.col()]);
-                        triplet.setRow(windowLocalIndicesU[triplet.row()]);
-                    }
-                }
+        // the index in the local copy of the strip of a non-local column,
+        // columnStrip tells us in which strip (+ 1) the index was set
+        std::vector<TIdx> columnIndices(cols);
+        std::vector<TIdx> columnStrip(cols, 0);
+
+        std::vector<TIdx> nonLocalColumns;
+        std::vector<TIdx> runOwners;
+        std::vector<TIdx> runStarts;
+        std::vector<TIdx> runLengths;
+        std::vector<TIdx> localRows;
+        std::vector<TIdx> localCols;
+        std::vector<TIdx> rowStarts;
+        std::vector<TIdx> nonEmpty;
+        std::vector<uint16_t> compact;
+
+        const TIdx indexBytes = localIndexBytes();
+        RawStreamWriter writer;
+        writer.reserve(nonZeros * (2 * indexBytes + sizeof(TVal)) +
+                       windowCount * 8 * sizeof(int) +
+                       strips_ * 4 * sizeof(int));
+
+        auto pushIndices = [&](const std::vector<TIdx>& indices) {
+            if (indexBytes == sizeof(TIdx)) {
+                writer.push(indices.data(), indices.size());
+            } else {
+                compact.assign(indices.begin(), indices.end());
+                writer.push(compact.data(), compact.size());
+            }
+        };
+        std::vector<TVal> values;
+
+        SparseStreamHeader<TIdx> header;
+        header.numStrips = strips_;
+        header.indexBytes = indexBytes;
+        header.layout = (TIdx)layout_;
+
+        windowSizeU_[s].assign(windowCount, 0);
+        upIndices_[s].clear();
+        upStreamSize_[s] = 0;
+        upStreamChunkSize_[s] = 0;
+
+        header.write(writer);
+
+        for (TIdx strip = 0; strip < strips_; ++strip) {
+            const TIdx stripBegin = strip * stripSize_;
+            const TIdx stripEnd = std::min(cols, stripBegin + stripSize_);
+            TIdx numLocalV = 0;
+            for (TIdx column = stripBegin; column < stripEnd; ++column) {
+                if (owners[column] == s)
+                    ++numLocalV;
+            }
+            header.maxSizeV = std::max(header.maxSizeV, numLocalV);
+
+            // windows without nonzeros are left out
+            nonEmpty.clear();
+            for (TIdx window = 0; window < windows_; ++window) {
+                const std::size_t windowIdx =
+                    (std::size_t)strip * windows_ + window;
+                if (windowStart[windowIdx + 1] > windowStart[windowIdx])
+                    nonEmpty.push_back(window);
             }
-        }
 
-        std::array<TIdx, stream_config::processors> streamSize;
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            streamSize[s] = headers[s].sizeInBytes();
-            for (TIdx strip = 0; strip < strips; ++strip) {
-                streamSize[s] += stripHeaders[s][strip].sizeInBytes();
-                for (TIdx window = 0; window < windows; ++window) {
-                    TIdx windowIdx = strip * windows + window;
-                    streamSize[s] += windowChunks[s][windowIdx].sizeInBytes();
+            // the non-local columns that the windows of the strip need are
+            // fetched once per strip, sorted by owner and index so that
+            // consecutive components of an owner are fetched as one run.
+            // The index increases with the column, so we sort the marked
+            // columns of the strip by owner.
+            for (std::size_t k = windowStart[(std::size_t)strip * windows_];
+                 k < windowStart[(std::size_t)(strip + 1) * windows_]; ++k) {
+                TIdx col = triplets[order[k]].col();
+                if (owners[col] != s)
+                    columnStrip[col] = strip + 1;
+            }
+            std::array<std::size_t, stream_config::processors + 1>
+                ownerStart = {};
+            for (TIdx column = stripBegin; column < stripEnd; ++column)
+                if (columnStrip[column] == strip + 1)
+                    ownerStart[owners[column] + 1]++;
+            for (TIdx t = 0; t < stream_config::processors; ++t)
+                ownerStart[t + 1] += ownerStart[t];
+            nonLocalColumns.resize(ownerStart[stream_config::processors]);
+            for (TIdx column = stripBegin; column < stripEnd; ++column)
+                if (columnStrip[column] == strip + 1)
+                    nonLocalColumns[ownerStart[owners[column]]++] = column;
+
+            runOwners.clear();
+            runStarts.clear();
+            runLengths.clear();
+            for (std::size_t position = 0; position < nonLocalColumns.size();
+                 ++position) {
+                const TIdx col = nonLocalColumns[position];
+                columnIndices[col] = numLocalV + position;
+                if (!runOwners.empty() && runOwners.back() == owners[col] &&
+                    runStarts.back() + runLengths.back() ==
+                        stripLocalIndices[col]) {
+                    runLengths.back()++;
+                } else {
+                    runOwners.push_back(owners[col]);
+                    runStarts.push_back(stripLocalIndices[col]);
+                    runLengths.push_back(1);
                 }
             }
+            const TIdx runs = runOwners.size();
+            header.maxNonLocal =
+                std::max<TIdx>(header.maxNonLocal, nonLocalColumns.size());
+
+            writer.beginChunk();
+            writer.push((TIdx)nonEmpty.size());
+            writer.push(numLocalV);
+            writer.push((TIdx)stripFetches[strip]);
+            writer.push(runs);
+            writer.push(nonEmpty.data(), nonEmpty.size());
+            writer.push(runOwners.data(), runs);
+            writer.push(runStarts.data(), runs);
+            writer.push(runLengths.data(), runs);
+            writer.endChunk();
+
+            for (auto window : nonEmpty) {
+                const std::size_t windowIdx =
+                    (std::size_t)strip * windows_ + window;
+
+                localRows.clear();
+                localCols.clear();
+                rowStarts.clear();
+                values.clear();
+
+                // the rows of the window are appended to the up indices
+                auto& upIndices = upIndices_[s];
+                const std::size_t windowStartU = upIndices.size();
+                for (std::size_t k = windowStart[windowIdx];
+                     k < windowStart[windowIdx + 1]; ++k) {
+                    const auto& triplet = triplets[order[k]];
+
+                    // the triplets are sorted by row
+                    if (upIndices.size() == windowStartU ||
+                        upIndices.back() != triplet.row()) {
+                        upIndices.push_back(triplet.row());
+                        rowStarts.push_back(values.size());
+                    }
+                    localRows.push_back(upIndices.size() - windowStartU - 1);
+
+                    TIdx col = triplet.col();
+                    if (owners[col] == s)
+                        localCols.push_back(stripLocalIndices[col]);
+                    else
+                        localCols.push_back(columnIndices[col]);
+                    values.push_back(triplet.value());
+                }
 
-            ZeeLogVar(streamSize[s]);
-            sparseData_[s] = operator new(streamSize[s]);
+                const TIdx sizeU = upIndices.size() - windowStartU;
+                const TIdx windowSize = values.size();
 
-            headers[s].write(&sparseData_[s]);
-            for (TIdx strip = 0; strip < strips; ++strip) {
-                stripHeaders[s][strip].write(&sparseData_[s]);
-                for (TIdx window = 0; window < windows; ++window) {
-                    TIdx windowIdx = strip * windows + window;
-                    windowChunks[s][windowIdx].write(&sparseData_[s]);
+                windowSizeU_[s][windowIdx] = sizeU;
+                upStreamSize_[s] += sizeU * sizeof(TVal);
+                upStreamChunkSize_[s] = std::max<TIdx>(
+                    upStreamChunkSize_[s], sizeU * sizeof(TVal));
+
+                header.maxSizeU = std::max(header.maxSizeU, sizeU);
+                header.maxWindowSize =
+                    std::max(header.maxWindowSize, windowSize);
+
+                writer.beginChunk();
+                writer.push(sizeU);
+                writer.push(windowSize);
+                if (layout_ == window_layout::csr) {
+                    rowStarts.push_back(windowSize);
+                    pushIndices(rowStarts);
+                } else {
+                    pushIndices(localRows);
                 }
+                pushIndices(localCols);
+                const std::size_t indexCount =
+                    localCols.size() + (layout_ == window_layout::csr
+                                            ? rowStarts.size()
+                                            : localRows.size());
+                if (indexBytes == sizeof(uint16_t) && indexCount % 2 != 0)
+                    writer.push<uint16_t>(0);
+                writer.push(values.data(), windowSize);
+                writer.endChunk();
             }
         }
 
-        ZeeLogDebug << "Finished constructing stream" << endLog;
-    }
-
-    TIdx upStreamSize(TIdx proc) const {
-        return upStreamSize_[proc];
-    }
-
-    TIdx upStreamChunkSize(TIdx proc) const {
-        return upStreamChunkSize_[proc];
-    }
-
-    const std::array<std::vector<std::vector<TIdx>>, stream_config::processors>&
-    getLocalToGlobalU() const {
-        return localToGlobalU_;
-    }
-
-    const std::array<std::vector<TIdx>, stream_config::processors>&
-    getWindowSizeU() const {
-        return windowSizeU_;
+        header.update(writer);
+        sparseData_[s] = std::move(writer.data());
+        streamData_[s] = sparseData_[s].data();
+        streamSizes_[s] = sparseData_[s].size();
+        maxChunkSizes_[s] = writer.maxChunkSize();
     }
 
-  private:
     TMatrix& A_;
     TVector& v_;
 
     TIdx stripSize_;
     TIdx windowSize_;
+    TIdx strips_ = 0;
+    TIdx windows_ = 0;
+    bool compactIndices_ = true;
+    window_layout layout_ = window_layout::triplets;
 
-    std::array<std::vector<std::vector<TIdx>>, stream_config::processors>
-        localToGlobalU_;
-
-    std::array<TIdx, stream_config::processors> upStreamSize_;
-    std::array<TIdx, stream_config::processors> upStreamChunkSize_;
+    std::array<TIdx, stream_config::processors> upStreamSize_ = {};
+    std::array<TIdx, stream_config::processors> upStreamChunkSize_ = {};
     std::array<std::vector<TIdx>, stream_config::processors> windowSizeU_;
-
-    std::array<void*, stream_config::processors> sparseData_;
+    std::array<std::vector<TIdx>, stream_config::processors> upIndices_;
+
+    // the streams are either owned, or part of a cache file that is mapped
+    // into memory
+    std::array<std::vector<char>, stream_config::processors> sparseData_;
+    std::shared_ptr<MappedFile> mapped_;
+    std::array<const char*, stream_config::processors> streamData_ = {};
+    std::array<std::size_t, stream_config::processors> streamSizes_ = {};
+    std::array<int, stream_config::processors> maxChunkSizes_ = {};
+    // identifies the contents of the streams in the session
+    std::uint64_t streamKey_ = 0;
+
+    std::array<std::vector<char>, stream_config::processors> vectorData_;
+    std::array<int, stream_config::processors> vectorMaxChunkSizes_ = {};
+    // the number of vectors that are interleaved in the vector streams
+    TIdx vectorCount_ = 1;
+    std::array<std::vector<TIdx>, stream_config::processors> vectorIndices_;
+    std::array<std::vector<TIdx>, stream_config::processors>
+        vectorStripSizes_;
 };
 
 template <typename TVal, typename TIdx>
@@ -369,15 +1013,14 @@ class SpMVUpStream
     SpMVUpStream() : chunkSizes_(), totalSizes_() {}
 
     void createUp() override {
-        ZeeAssert(this->chunkSize_ != 0);
-        ZeeAssert(this->totalSize_ != 0);
-
-        TIdx totalSize = this->getTotalSize();
-        TIdx chunkSize = this->getChunkSize();
-
         for (TIdx s = 0; s < stream_config::processors; s++) {
-            this->rawData_[s] =
-                (TVal*)ebsp_create_up_stream(s, totalSize, chunkSize);
+            // a processor without nonzeros still gets a (small) stream
+            Session::instance().createUpStream(
+                s, std::max<TIdx>(totalSizes_[s], sizeof(TVal)),
+                std::max<TIdx>(chunkSizes_[s], sizeof(TVal)),
+                [this, s](void* address) {
+                    this->rawData_[s] = (TVal*)address;
+                });
         }
     }
 
@@ -389,30 +1032,98 @@ class SpMVUpStream
         totalSizes_[proc] = size;
     }
 
+    /* Add the partial sums of the windows to u. A row can have nonzeros in
+     * many strips and processors, so u should be zero initially.
+     *
+     * The buffers are scattered in parallel, by groups of processors that
+     * each have their own accumulator. The first group adds to u directly,
+     * the other accumulators are added to u afterwards. */
     void fill(DStreamingVector<TVal, TIdx>& u,
               const SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
                                  DStreamingVector<TVal, TIdx>>& downStream) {
-        auto& localToGlobalU = downStream.getLocalToGlobalU();
+        fill_(&u.at(0), u.size(), 1, downStream);
+    }
 
-        for (TIdx s = 0; s < stream_config::processors; ++s) {
-            TIdx offset = 0;
-            TIdx windowIdx = 0;
-            TIdx globalIdx = 0;
-            TVal* data = this->rawData_[s];
-            while (offset < totalSizes_[s]) {
-                for (TIdx idx = 0; idx < downStream.getWindowSizeU()[s][windowIdx];
-                     ++idx) {
-                    u.at(localToGlobalU[s][windowIdx][idx]) = data[globalIdx++];
-                }
-                ++windowIdx;
+    /* The same for a block of vectors that were multiplied at once, the up
+     * streams hold the partial sums of all vectors for every row. */
+    void fill(std::vector<DStreamingVector<TVal, TIdx>>& U,
+              const SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
+                                 DStreamingVector<TVal, TIdx>>& downStream) {
+        ZeeAssert(!U.empty());
+        const TIdx vectors = U.size();
+        const std::size_t rows = U[0].size();
+        std::vector<TVal> block(rows * vectors, (TVal)0);
+        fill_(block.data(), rows, vectors, downStream);
+
+        for (TIdx j = 0; j < vectors; ++j)
+            for (std::size_t i = 0; i < rows; ++i)
+                U[j].at(i) += block[i * vectors + j];
+    }
+
+  private:
+    // target holds the rows of u for every vector, row major
+    void fill_(TVal* target, std::size_t rows, TIdx vectors,
+               const SparseStream<DStreamingSparseMatrix<TVal, TIdx>,
+                                  DStreamingVector<TVal, TIdx>>& downStream) {
+        auto& pool = hostThreadPool();
+        const std::size_t size = rows * vectors;
+        const TIdx groups =
+            std::min<TIdx>(pool.size(), stream_config::processors);
+        const auto& upIndices = downStream.getUpIndices();
+
+        std::vector<std::vector<TVal>> partials(groups - 1);
+        pool.parallelFor(groups, [&](TIdx group) {
+            TVal* result = target;
+            if (group > 0) {
+                partials[group - 1].assign(size, (TVal)0);
+                result = partials[group - 1].data();
+            }
+            for (TIdx s = group; s < stream_config::processors; s += groups) {
+                if (vectors == 1)
+                    scatterAdd_(result, upIndices[s].data(),
+                                this->rawData_[s], upIndices[s].size());
+                else
+                    scatterAddBlock_(result, upIndices[s].data(),
+                                     this->rawData_[s], upIndices[s].size(),
+                                     vectors);
             }
+        });
+
+        if (partials.empty())
+            return;
+
+        const std::size_t blockSize = (size - 1) / groups + 1;
+        pool.parallelFor(groups, [&](TIdx block) {
+            const std::size_t begin = block * blockSize;
+            const std::size_t end = std::min(size, begin + blockSize);
+            for (const auto& partial : partials)
+                for (std::size_t i = begin; i < end; ++i)
+                    target[i] += partial[i];
+        });
+    }
+
+    static void scatterAdd_(TVal* __restrict__ result,
+                            const TIdx* __restrict__ indices,
+                            const TVal* __restrict__ data, std::size_t count) {
+        for (std::size_t k = 0; k < count; ++k)
+            result[indices[k]] += data[k];
+    }
+
+    static void scatterAddBlock_(TVal* __restrict__ result,
+                                 const TIdx* __restrict__ indices,
+                                 const TVal* __restrict__ data,
+                                 std::size_t count, TIdx vectors) {
+        for (std::size_t k = 0; k < count; ++k) {
+            TVal* __restrict__ row = result + (std::size_t)indices[k] * vectors;
+            const TVal* __restrict__ sums = data + k * vectors;
+            for (TIdx j = 0; j < vectors; ++j)
+                row[j] += sums[j];
         }
     }
 
-  private:
     // these are per processor
-    std::array<TIdx, stream_config::processors> chunkSizes_ = 0;
-    std::array<TIdx, stream_config::processors> totalSizes_ = 0;
+    std::array<TIdx, stream_config::processors> chunkSizes_ = {};
+    std::array<TIdx, stream_config::processors> totalSizes_ = {};
 };
 
 } // namespace Zephany
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+#include "sparse_stripped.hpp"
+#include "../operations/backend.hpp"
+#include "../operations/host.hpp"
+#include "../operations/operations.hpp"
+
+namespace Zephany {
+
+// How the predicted best configurations are confirmed, if at all
+enum class tuning_timing { none, device, host };
+
+/* Chooses the strip and window sizes of a SparseStream for a matrix and
+ * the distribution of a vector.
+ *
+ * Every pair of candidate sizes is prepared, and its streams are measured:
+ * the local memory that k_spmv needs on the core that needs the most, and
+ * the bytes that are moved to and from that core. Every chunk and every
+ * transfer of a run of non-local components is charged an additional
+ * message cost, so that small windows are not taken for free. Candidates
+ * that do not fit in the local memory budget are rejected, and the one
+ * with the lowest predicted volume is chosen.
+ *
+ * Optionally, the best few candidates are timed on the device, or on the
+ * host with host::spmvStream, and the fastest of them is chosen. The host
+ * stand-in multiplies a single vector. */
+template <typename TMatrix, typename TVector>
+class SparseStreamTuner {
+  public:
+    using TVal = typename TMatrix::value_type;
+    using TIdx = typename TMatrix::index_type;
+
+    struct Candidate {
+        TIdx stripSize = 0;
+        TIdx windowSize = 0;
+        // the local memory of k_spmv, the largest over the cores
+        std::size_t localMemory = 0;
+        // bytes and messages of the core with the highest predicted volume
+        std::size_t bytes = 0;
+        std::size_t messages = 0;
+        std::size_t predicted = 0;
+        bool fits = false;
+        // seconds per product, negative if it was not timed
+        double seconds = -1.0;
+    };
+
+    SparseStreamTuner(TMatrix& A, TVector& v) : A_(A), v_(v) {}
+
+    /* The sizes that are tried for both the strips and the windows, sizes
+     * that are not smaller than the matrix are skipped. */
+    void setSizes(std::vector<TIdx> sizes) { sizes_ = sizes; }
+
+    /* The bytes of local memory that the streams and buffers of a core may
+     * use, the remainder of the 32 KB holds the program and its stack. */
+    void setLocalMemory(std::size_t bytes) { localMemory_ = bytes; }
+
+    /* The cost of a chunk or a transfer, in bytes. */
+    void setMessageCost(std::size_t bytes) { messageCost_ = bytes; }
+
+    void setLayout(window_layout layout) { layout_ = layout; }
+
+    /* The number of vectors that are multiplied at once, see spmm(). The
+     * vector buffers and the partial sums grow with it, the windows do
+     * not. */
+    void setVectorCount(TIdx vectors) { vectors_ = vectors; }
+
+    /* Time the `count` candidates with the lowest predicted volume, and
+     * choose the fastest. */
+    void setTiming(tuning_timing timing, TIdx count = 3,
+                   int repetitions = 3) {
+        timing_ = timing;
+        timedCount_ = count;
+        repetitions_ = repetitions;
+    }
+
+    /* Measure every candidate, and return the chosen one. The stream that
+     * A uses, if any, is restored afterwards. */
+    Candidate tune() {
+        auto previous = A_.hasStream() ? &A_.getStream() : nullptr;
+
+        candidates_.clear();
+        for (auto stripSize : sizes_) {
+            for (auto windowSize : sizes_) {
+                if (stripSize >= A_.getCols() || windowSize >= A_.getRows())
+                    continue;
+                candidates_.push_back(measure_(stripSize, windowSize));
+            }
+        }
+        ZeeAssertMsg(!candidates_.empty(), "No candidate sizes to tune");
+
+        std::vector<Candidate*> order;
+        for (auto& candidate : candidates_)
+            if (candidate.fits)
+                order.push_back(&candidate);
+        ZeeAssertMsg(!order.empty(),
+                     "No candidate fits in the local memory budget");
+        std::stable_sort(order.begin(), order.end(),
+                         [](const Candidate* lhs, const Candidate* rhs) {
+                             return lhs->predicted < rhs->predicted;
+                         });
+
+        Candidate* best = order.front();
+        if (timing_ != tuning_timing::none) {
+            order.resize(std::min<std::size_t>(order.size(), timedCount_));
+            for (auto candidate : order) {
+                candidate->seconds = time_(*candidate);
+                if (candidate->seconds < best->seconds)
+                    best = candidate;
+            }
+        }
+
+        A_.setStream(previous);
+
+        ZeeLogInfo << "Tuned strip size " << best->stripSize
+                   << ", window size " << best->windowSize << endLog;
+        return *best;
+    }
+
+    /* Every candidate that was measured by the last tune(). */
+    const std::vector<Candidate>& getCandidates() const {
+        return candidates_;
+    }
+
+  private:
+    Candidate measure_(TIdx stripSize, TIdx windowSize) {
+        SparseStream<TMatrix, TVector> stream(A_, v_, stripSize, windowSize);
+        stream.setLayout(layout_);
+        stream.prepareStream();
+
+        Candidate candidate;
+        candidate.stripSize = stripSize;
+        candidate.windowSize = windowSize;
+        for (TIdx s = 0; s < stream_config::processors; ++s) {
+            candidate.localMemory = std::max(candidate.localMemory,
+                                             stream.localMemory(s, vectors_));
+
+            // the header, and for every strip a header and a vector chunk,
+            // and for every window a chunk down and a chunk up
+            std::size_t windows = 0;
+            for (auto sizeU : stream.getWindowSizeU()[s])
+                windows += sizeU > 0;
+            auto fetches = stream.getFetchStatistics(s);
+            const std::size_t messages =
+                1 + 2 * (std::size_t)stream.getHeader(s).numStrips +
+                2 * windows + fetches.runs;
+            const std::size_t bytes =
+                stream.getRawStreamSize(s) +
+                (stream.getVectorStream(s).size() + stream.upStreamSize(s) +
+                 fetches.components * sizeof(TVal)) *
+                    vectors_;
+
+            const std::size_t predicted = bytes + messageCost_ * messages;
+            if (predicted > candidate.predicted) {
+                candidate.bytes = bytes;
+                candidate.messages = messages;
+                candidate.predicted = predicted;
+            }
+        }
+        candidate.fits = candidate.localMemory <= localMemory_;
+        return candidate;
+    }
+
+    double time_(const Candidate& candidate) {
+        SparseStream<TMatrix, TVector> stream(A_, v_, candidate.stripSize,
+                                              candidate.windowSize);
+        stream.setLayout(layout_);
+        stream.prepareStream();
+
+        // the product is timed on the device, whatever the backend
+        auto backend = getBackend();
+        if (timing_ == tuning_timing::device)
+            setBackend(execution_backend::device);
+
+        TVector u(A_.getRows());
+        std::vector<TVector> X(vectors_, v_);
+        double best = std::numeric_limits<double>::max();
+        for (int r = 0; r < repetitions_; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            if (timing_ == tuning_timing::device && vectors_ > 1) {
+                spmm(A_, X);
+            } else if (timing_ == tuning_timing::device) {
+                u = A_ * v_;
+            } else {
+                stream.updateVector(v_);
+                host::spmvStream(stream, u);
+            }
+            best = std::min(best, std::chrono::duration<double>(
+                                      std::chrono::steady_clock::now() -
+                                      start).count());
+        }
+
+        setBackend(backend);
+        return best;
+    }
+
+    TMatrix& A_;
+    TVector& v_;
+
+    std::vector<TIdx> sizes_ = {16, 32, 64, 128, 256, 512, 1024};
+    std::size_t localMemory_ = stream_config::buffer_memory;
+    std::size_t messageCost_ = 64;
+    window_layout layout_ = window_layout::triplets;
+    TIdx vectors_ = 1;
+
+    tuning_timing timing_ = tuning_timing::none;
+    TIdx timedCount_ = 3;
+    int repetitions_ = 3;
+
+    std::vector<Candidate> candidates_;
+};
+
+} // namespace Zephany
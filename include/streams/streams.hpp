@@ -9,17 +9,11 @@ extern "C" {
 #include <vector>
 #include <algorithm>
 
-#ifndef ZEPHANY_MESH_SIZE
-#define ZEPHANY_MESH_SIZE 4
-#endif
+#include "config.hpp"
+#include "session.hpp"
 
 namespace Zephany {
 
-namespace stream_config {
-static constexpr unsigned int N = ZEPHANY_MESH_SIZE;
-static constexpr unsigned int processors = N * N;
-}
-
 enum class stream_direction { up, down };
 
 template <typename T, typename TIdx = Zee::default_index_type>
@@ -37,6 +31,11 @@ class Stream {
         return data_;
     }
 
+    const std::array<std::vector<T>, stream_config::processors>&
+    getData() const {
+        return data_;
+    }
+
     void setInitialized() { initialized_ = true; }
 
     virtual void create() const = 0;
@@ -68,7 +67,9 @@ class UpStream : public Stream<T, TIdx> {
         TIdx chunkSize = this->getChunkSize();
 
         for (TIdx s = 0; s < stream_config::processors; s++) {
-            this->rawData_[s] = (T*)ebsp_create_up_stream(s, totalSize, chunkSize);
+            Session::instance().createUpStream(
+                s, totalSize, chunkSize,
+                [this, s](void* address) { this->rawData_[s] = (T*)address; });
         }
     }
 
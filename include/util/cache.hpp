@@ -0,0 +1,74 @@
+#pragma once
+
+#include <zee.hpp>
+
+#include <cstdint>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Zephany {
+
+/* 64-bit FNV-1a hash, used to identify cached data. */
+class Hasher {
+  public:
+    void add(const void* data, std::size_t bytes) {
+        auto ptr = (const unsigned char*)data;
+        for (std::size_t i = 0; i < bytes; ++i) {
+            hash_ ^= ptr[i];
+            hash_ *= 1099511628211ull;
+        }
+    }
+
+    template <typename T>
+    void add(const T& value) {
+        add(&value, sizeof(T));
+    }
+
+    std::uint64_t value() const { return hash_; }
+
+  private:
+    std::uint64_t hash_ = 14695981039346656037ull;
+};
+
+/* A read-only memory map of a file. */
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE,
+                              fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = (const char*)data;
+                size_ = info.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_)
+            munmap((void*)data_, size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+  private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+} // namespace Zephany
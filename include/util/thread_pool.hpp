@@ -0,0 +1,135 @@
+#pragma once
+
+#include <zee.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Zephany {
+
+/* A fixed set of worker threads that execute parallel loops on the host.
+ * Loops are blocking, and the calling thread takes part in the work. */
+class ThreadPool {
+  public:
+    explicit ThreadPool(unsigned int threads = 0) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (unsigned int t = 1; t < threads; ++t)
+            workers_.emplace_back([this] { work_(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int size() const { return workers_.size() + 1; }
+
+    /* Call f(i) for every i in [0, count), the order is unspecified. Loops
+     * cannot be nested. */
+    template <typename TIdx, typename TFunc>
+    void parallelFor(TIdx count, TFunc&& f) {
+        if (count == 0)
+            return;
+
+        if (workers_.empty() || count == 1) {
+            for (TIdx i = 0; i < count; ++i)
+                f(i);
+            return;
+        }
+
+        // only one loop can be in flight at a time
+        std::lock_guard<std::mutex> loopLock(loopMutex_);
+
+        std::function<void(std::size_t)> task = [&f](std::size_t i) {
+            f((TIdx)i);
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            count_ = count;
+            next_ = 0;
+            pending_ = count;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        runTasks_();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        task_ = nullptr;
+    }
+
+  private:
+    void work_() {
+        unsigned long long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock,
+                           [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+            }
+            runTasks_();
+        }
+    }
+
+    void runTasks_() {
+        while (true) {
+            std::size_t i = 0;
+            const std::function<void(std::size_t)>* task = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!task_ || next_ >= count_)
+                    return;
+                i = next_++;
+                task = task_;
+            }
+
+            (*task)(i);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0)
+                done_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+
+    std::mutex loopMutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    const std::function<void(std::size_t)>* task_ = nullptr;
+    std::size_t count_ = 0;
+    std::size_t next_ = 0;
+    std::size_t pending_ = 0;
+    unsigned long long generation_ = 0;
+    bool stop_ = false;
+};
+
+/* The pool shared by the host implementations of Zephany. */
+inline ThreadPool& hostThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+} // namespace Zephany
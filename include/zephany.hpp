@@ -18,4 +18,7 @@ License, or (at your option) any later version.
 #include "streams/streams.hpp"
 #include "streams/matrix_block.hpp"
 #include "streams/sparse_stripped.hpp"
+#include "streams/external.hpp"
 #include "operations/operations.hpp"
+#include "operations/async.hpp"
+#include "streams/sparse_tuner.hpp"
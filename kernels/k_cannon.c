@@ -1,18 +1,72 @@
 #include <e_bsp.h>
 #include <stdint.h>
 
-void get_parameters(int* inner_block_size, int* outer_blocks, int* N);
-void matrix_multiply_add(float* A, float* B, float* C, int inner_block_size);
+#include "matrix_multiply_add.h"
+
+// The kernel can be compiled for a fixed inner block size by defining
+// INNER_BLOCK_SIZE, so that the loops of the multiply-add have constant
+// bounds and can be unrolled completely. The host only runs such a variant
+// for streams with that inner block size, and checks this before it starts
+// the kernel, the check here only guards against other hosts.
+#ifdef INNER_BLOCK_SIZE
+#define BLOCK_SIZE(size) INNER_BLOCK_SIZE
+#else
+#define BLOCK_SIZE(size) (size)
+#endif
+
+void get_parameters(int* inner_block_size, int* outer_blocks, int* N,
+                    int* a_orientation, int* b_orientation, int* tile_rows,
+                    int* tile_cols, int* outer_rows, int* outer_cols);
+void seek_chunk(int stream_id, int* position, int target);
+int stream_position(int orientation, int rows, int cols, int i, int j);
+void step_chunks(int step, int outer_blocks, int row_tiles, int col_tiles,
+                 int a_orientation, int b_orientation, int* a_chunk,
+                 int* b_chunk);
 
 int main() {
     bsp_begin();
 
-    // Obtain Cannon parameters from the host
+    // Obtain Cannon parameters from the host, C has outer_rows x outer_cols
+    // outer blocks, padded to whole tiles, and A and B have outer_blocks
+    // outer blocks along their inner dimension. For square matrices only
+    // outer_blocks is sent.
     int inner_block_size = 0;
     int outer_blocks = 0;
+    int outer_rows = 0;
+    int outer_cols = 0;
     int N = 0;
-    get_parameters(&inner_block_size, &outer_blocks, &N);
-    int inner_block_bytes = inner_block_size * inner_block_size * sizeof(float);
+    // orientation 0: outer blocks are streamed in row major order, 1: column
+    // major order
+    int a_orientation = 0;
+    int b_orientation = 1;
+    // a tile of tile_rows x tile_cols outer blocks of C is computed at
+    // once, the chunks of A are panels of tile_rows outer blocks in a
+    // column, and those of B panels of tile_cols outer blocks in a row
+    int tile_rows = 1;
+    int tile_cols = 1;
+    get_parameters(&inner_block_size, &outer_blocks, &N, &a_orientation,
+                   &b_orientation, &tile_rows, &tile_cols, &outer_rows,
+                   &outer_cols);
+    if (outer_rows == 0)
+        outer_rows = outer_blocks;
+    if (outer_cols == 0)
+        outer_cols = outer_blocks;
+#ifdef INNER_BLOCK_SIZE
+    if (inner_block_size != INNER_BLOCK_SIZE) {
+        ebsp_message("k_cannon was compiled for inner blocks of size %i, not "
+                     "%i", INNER_BLOCK_SIZE, inner_block_size);
+        bsp_end();
+        return 1;
+    }
+#endif
+    const int block_elements =
+        BLOCK_SIZE(inner_block_size) * BLOCK_SIZE(inner_block_size);
+    int inner_block_bytes = block_elements * sizeof(float);
+    int a_panel_bytes = tile_rows * inner_block_bytes;
+    int b_panel_bytes = tile_cols * inner_block_bytes;
+    int tile_elements = tile_rows * tile_cols * block_elements;
+    int row_tiles = outer_rows / tile_rows;
+    int col_tiles = outer_cols / tile_cols;
 
     // Compute mesh position of this processor
     int s = bsp_pid();
@@ -23,121 +77,174 @@ int main() {
     int a_neighbor = si * N + ((sj + 1) % N);
     int b_neighbor = ((si + 1) % N) * N + sj;
 
-    // We define 5 buffers to hold the matrix blocks
-    float* a_data[2];
-    float* b_data[2];
+    // The panels of A and B are streamed in double buffered mode, so that
+    // the next panel is prefetched while the current one is multiplied. The
+    // inner blocks are shifted between the stream buffer that holds the
+    // current panel and a shift buffer, and the tile of C is double buffered
+    // so that it is sent up while the next tile is computed. This takes
+    // 3 g_r + 3 g_c + 2 g_r g_c inner blocks of local memory, for tiles of
+    // g_r x g_c outer blocks.
+    //
+    // A double buffered move prefetches the chunk that follows it in the
+    // stream, and the next move returns that chunk even if the cursor has
+    // been moved. A panel is therefore only moved in double buffered mode
+    // if the panel of the next step follows it, otherwise it is moved
+    // single buffered and the cursor is moved before the next move.
+    const int prefetch = 1;
+
+    float* a_buffers[2];
+    float* b_buffers[2];
+    float* a_shift = ebsp_malloc(a_panel_bytes);
+    float* b_shift = ebsp_malloc(b_panel_bytes);
     float* c_data = 0;
 
-    // Whether we want to use double-buffering for C
-    const int fastmode = 0;
+    ebsp_open_down_stream((void**)&a_buffers[0], 0);
+    ebsp_open_down_stream((void**)&b_buffers[0], 1);
+    ebsp_open_up_stream((void**)&c_data, 2);
 
-    // Allocate local buffers
-    ebsp_open_down_stream((void**)&a_data[0], 0);
-    a_data[1] = ebsp_malloc(inner_block_bytes);
-    ebsp_open_down_stream((void**)&b_data[0], 1);
-    b_data[1] = ebsp_malloc(inner_block_bytes);
+    // The chunk index of the next chunk in the A and B streams
+    int a_position = 0;
+    int b_position = 0;
 
-    ebsp_open_up_stream((void**)&c_data, 2);
+    // The chunks that hold the panels of A and B in the current and the
+    // next step
+    int total_block_count = row_tiles * col_tiles * outer_blocks;
+    int a_chunk = 0;
+    int b_chunk = 0;
+    int a_next = -1;
+    int b_next = -1;
+    step_chunks(0, outer_blocks, row_tiles, col_tiles, a_orientation,
+                b_orientation, &a_chunk, &b_chunk);
+    if (total_block_count > 1)
+        step_chunks(1, outer_blocks, row_tiles, col_tiles, a_orientation,
+                    b_orientation, &a_next, &b_next);
 
-    // Set C to zero
-    for (int i = 0; i < inner_block_size * inner_block_size; ++i) {
-        a_data[1][i] = -1.0f;
-        b_data[1][i] = -1.0f;
-        c_data[i] = 0.0f;
-    }
+    // The first panels of A and B are moved down before the buffers are
+    // registered, since the second stream buffer is only allocated by the
+    // first double buffered move. A stream whose first move can not
+    // prefetch is moved single buffered throughout, and uses one buffer.
+    int a_prefetch = a_next == a_chunk + 1 ? prefetch : 0;
+    int b_prefetch = b_next == b_chunk + 1 ? prefetch : 0;
+    const int a_double_buffered = a_prefetch;
+    const int b_double_buffered = b_prefetch;
+    float* a_data = 0;
+    float* b_data = 0;
+    seek_chunk(0, &a_position, a_chunk);
+    seek_chunk(1, &b_position, b_chunk);
+    ebsp_move_chunk_down((void**)&a_data, 0, a_prefetch);
+    ebsp_move_chunk_down((void**)&b_data, 1, b_prefetch);
+    a_buffers[1] = a_data;
+    b_buffers[1] = b_data;
 
+    for (int i = 0; i < tile_elements; ++i)
+        c_data[i] = 0.0f;
 
     // Register the locations of our buffers
-    bsp_push_reg(a_data[0], inner_block_bytes);
+    bsp_push_reg(a_buffers[0], a_panel_bytes);
     bsp_sync();
-    bsp_push_reg(a_data[1], inner_block_bytes);
+    if (a_double_buffered) {
+        bsp_push_reg(a_buffers[1], a_panel_bytes);
+        bsp_sync();
+    }
+    bsp_push_reg(a_shift, a_panel_bytes);
     bsp_sync();
-    bsp_push_reg(b_data[0], inner_block_bytes);
+    bsp_push_reg(b_buffers[0], b_panel_bytes);
     bsp_sync();
-    bsp_push_reg(b_data[1], inner_block_bytes);
+    if (b_double_buffered) {
+        bsp_push_reg(b_buffers[1], b_panel_bytes);
+        bsp_sync();
+    }
+    bsp_push_reg(b_shift, b_panel_bytes);
     bsp_sync();
 
-    // We store our neighbor's buffer locations
-    float* neighbor_a_data[2];
-    float* neighbor_b_data[2];
-
-    // Obtain neighbor locations
-    neighbor_a_data[0] = ebsp_get_direct_address(a_neighbor, a_data[0]);
-    neighbor_a_data[1] = ebsp_get_direct_address(a_neighbor, a_data[1]);
-    neighbor_b_data[0] = ebsp_get_direct_address(b_neighbor, b_data[0]);
-    neighbor_b_data[1] = ebsp_get_direct_address(b_neighbor, b_data[1]);
+    // We store our neighbor's buffer locations, the buffers of every core
+    // are used in the same order
+    float* neighbor_a_buffers[2];
+    float* neighbor_b_buffers[2];
+    neighbor_a_buffers[0] = ebsp_get_direct_address(a_neighbor, a_buffers[0]);
+    neighbor_a_buffers[1] = ebsp_get_direct_address(a_neighbor, a_buffers[1]);
+    neighbor_b_buffers[0] = ebsp_get_direct_address(b_neighbor, b_buffers[0]);
+    neighbor_b_buffers[1] = ebsp_get_direct_address(b_neighbor, b_buffers[1]);
+    float* neighbor_a_shift = ebsp_get_direct_address(a_neighbor, a_shift);
+    float* neighbor_b_shift = ebsp_get_direct_address(b_neighbor, b_shift);
 
     // We use the DMA manually to send the inner matrix blocks to our neighbours
     ebsp_dma_handle dma_handle_a;
     ebsp_dma_handle dma_handle_b;
 
-    // Loop over the outer blocks (chunks)
-    int total_block_count = outer_blocks * outer_blocks * outer_blocks;
-    for (int cur_block = 0; cur_block <= total_block_count; ++cur_block) {
-        // See if we have something to send up
+    // Loop over the tiles of C and the outer blocks (panels) of A and B,
+    // step cur_block of C = A * B is C_IJ += A_IK * B_KJ for the outer
+    // blocks C_IJ of tile (tile_i, tile_j)
+    for (int cur_block = 0; cur_block < total_block_count; ++cur_block) {
         if (cur_block != 0) {
-            if (cur_block % (outer_blocks * outer_blocks) == 0) {
-                ebsp_move_down_cursor(
-                    1,                               // stream id
-                    -(outer_blocks * outer_blocks)); // relative chunk count
-            } else if (cur_block % outer_blocks == 0) {
-                ebsp_move_down_cursor(0,              // stream id
-                                      -outer_blocks); // relative chunk count
-            }
-            if (cur_block % outer_blocks == 0) {
-                // Send result of C upwards
-                ebsp_move_chunk_up((void*)&c_data, 2, fastmode);
-                ebsp_barrier();
-
-                // FIXME find more elegant way of accomplishing this.
-                if (cur_block == total_block_count) {
-                    break;
-                }
-
-                // Set C to zero
-                for (int i = 0; i < inner_block_size * inner_block_size; ++i)
-                    c_data[i] = 0;
-            }
+            // Move the streams to the panels of A and B, in double buffered
+            // mode they land in the stream buffer that is not in use. The
+            // cursor is only moved when no chunk has been prefetched.
+            a_chunk = a_next;
+            b_chunk = b_next;
+            a_next = -1;
+            b_next = -1;
+            if (cur_block + 1 < total_block_count)
+                step_chunks(cur_block + 1, outer_blocks, row_tiles, col_tiles,
+                            a_orientation, b_orientation, &a_next, &b_next);
+            a_prefetch = a_double_buffered && a_next == a_chunk + 1;
+            b_prefetch = b_double_buffered && b_next == b_chunk + 1;
+            seek_chunk(0, &a_position, a_chunk);
+            seek_chunk(1, &b_position, b_chunk);
+            ebsp_move_chunk_down((void**)&a_data, 0, a_prefetch);
+            ebsp_move_chunk_down((void**)&b_data, 1, b_prefetch);
         }
 
-        // Obtain the inner blocks A_i, B_i
-        ebsp_move_chunk_down((void**)&a_data[0], // address
-                             0,                  // stream id
-                             0);                 // double buffered mode
-        ebsp_move_chunk_down((void**)&b_data[0], // address
-                             1,                  // stream id
-                             0);                 // double buffered mode
-
-        // Define indices into our buffers
-        int cur = 0;        // computation
-        int cur_buffer = 1; // data transfer
+        // The stream buffers that hold the panels, the other ones may be
+        // filled with the next panels. Every core moves its panels in the
+        // same way, so its neighbours use the same buffers.
+        int a_stream_buffer = a_data == a_buffers[1];
+        int b_stream_buffer = b_data == b_buffers[1];
 
-        // Multiply this block, by looping over the *inner blocks*
+        // Multiply this block, by looping over the *inner blocks*. In even
+        // steps the inner blocks are in the stream buffer, in odd steps in
+        // the shift buffer, and they are pushed to the other buffer of our
+        // neighbours while we compute.
+        float* a_cur = a_data;
+        float* b_cur = b_data;
         for (int i = 0; i < N; ++i) {
             if (i != N - 1) {
-                ebsp_dma_push(&dma_handle_a, neighbor_a_data[cur_buffer],
-                              a_data[cur], inner_block_bytes);
-                ebsp_dma_push(&dma_handle_b, neighbor_b_data[cur_buffer],
-                              b_data[cur], inner_block_bytes);
+                float* a_target = (i % 2 == 0)
+                                      ? neighbor_a_shift
+                                      : neighbor_a_buffers[a_stream_buffer];
+                float* b_target = (i % 2 == 0)
+                                      ? neighbor_b_shift
+                                      : neighbor_b_buffers[b_stream_buffer];
+                ebsp_dma_push(&dma_handle_a, a_target, a_cur, a_panel_bytes);
+                ebsp_dma_push(&dma_handle_b, b_target, b_cur, b_panel_bytes);
             }
 
-            // Perform C += A * B
-            matrix_multiply_add(a_data[cur], b_data[cur], c_data,
-                                inner_block_size);
+            // Perform C += A * B for every block of the tile
+            for (int a = 0; a < tile_rows; ++a)
+                for (int b = 0; b < tile_cols; ++b)
+                    matrix_multiply_add(
+                        a_cur + a * block_elements, b_cur + b * block_elements,
+                        c_data + (a * tile_cols + b) * block_elements,
+                        BLOCK_SIZE(inner_block_size));
 
-            if (i == N - 1)
-                break;
+            if (i != N - 1) {
+                ebsp_dma_wait(&dma_handle_a);
+                ebsp_dma_wait(&dma_handle_b);
+            }
 
-            // Switch buffers
-            cur_buffer = 1 - cur_buffer;
-            cur = 1 - cur;
+            // The neighbours write into the buffer that we just used, in the
+            // next step or in the first step of the next outer block
+            ebsp_barrier();
 
-            // FIXME: since we use memcpy instead of dma we commented this out
-            // ebsp_dma_wait(&dma_handle_a);
-            // ebsp_dma_wait(&dma_handle_b);
+            a_cur = (i % 2 == 0) ? a_shift : a_data;
+            b_cur = (i % 2 == 0) ? b_shift : b_data;
+        }
 
-            // Make sure every dma transfer is finished
-            ebsp_barrier();
+        if ((cur_block + 1) % outer_blocks == 0) {
+            // Send the tile of C upwards, and continue in the other buffer
+            ebsp_move_chunk_up((void**)&c_data, 2, prefetch);
+            for (int i = 0; i < tile_elements; ++i)
+                c_data[i] = 0.0f;
         }
     }
 
@@ -145,10 +252,15 @@ int main() {
     ebsp_close_down_stream(1);
     ebsp_close_up_stream(2);
 
+    ebsp_free(a_shift);
+    ebsp_free(b_shift);
+
     bsp_end();
 }
 
-void get_parameters(int* inner_block_size, int* outer_blocks, int* N) {
+void get_parameters(int* inner_block_size, int* outer_blocks, int* N,
+                    int* a_orientation, int* b_orientation, int* tile_rows,
+                    int* tile_cols, int* outer_rows, int* outer_cols) {
     int packets = 0;
     int accum_bytes = 0;
     int status = 0;
@@ -163,15 +275,49 @@ void get_parameters(int* inner_block_size, int* outer_blocks, int* N) {
             bsp_move(outer_blocks, sizeof(int));
         } else if (tag == 2) {
             bsp_move(N, sizeof(int));
+        } else if (tag == 3) {
+            bsp_move(a_orientation, sizeof(int));
+        } else if (tag == 4) {
+            bsp_move(b_orientation, sizeof(int));
+        } else if (tag == 5) {
+            bsp_move(tile_rows, sizeof(int));
+        } else if (tag == 6) {
+            bsp_move(tile_cols, sizeof(int));
+        } else if (tag == 7) {
+            bsp_move(outer_rows, sizeof(int));
+        } else if (tag == 8) {
+            bsp_move(outer_cols, sizeof(int));
         }
     }
 }
 
-// TODO: assembly
-void matrix_multiply_add(float* A, float* B, float* C, int inner_block_size) {
-    for (int i = 0; i < inner_block_size; ++i)
-        for (int j = 0; j < inner_block_size; j++)
-            for (int k = 0; k < inner_block_size; k++)
-                C[i * inner_block_size + j] +=
-                    A[i * inner_block_size + k] * B[k * inner_block_size + j];
+// Move the cursor of a down stream such that the next chunk is `target`, and
+// keep track of the position assuming that this chunk will be moved down
+void seek_chunk(int stream_id, int* position, int target) {
+    if (target != *position)
+        ebsp_move_down_cursor(stream_id, target - *position);
+    *position = target + 1;
+}
+
+// Index of chunk (i, j) in a stream of rows x cols chunks with the given
+// orientation
+int stream_position(int orientation, int rows, int cols, int i, int j) {
+    if (orientation == 0)
+        return i * cols + j;
+    return j * rows + i;
+}
+
+// The chunks of the A and B streams that hold the panels of a step, step
+// (tile_i * col_tiles + tile_j) * outer_blocks + k computes
+// C_IJ += A_IK * B_KJ for the outer blocks C_IJ of tile (tile_i, tile_j)
+void step_chunks(int step, int outer_blocks, int row_tiles, int col_tiles,
+                 int a_orientation, int b_orientation, int* a_chunk,
+                 int* b_chunk) {
+    int tile_i = step / (col_tiles * outer_blocks);
+    int tile_j = (step / outer_blocks) % col_tiles;
+    int block_k = step % outer_blocks;
+    *a_chunk = stream_position(a_orientation, row_tiles, outer_blocks, tile_i,
+                               block_k);
+    *b_chunk = stream_position(b_orientation, outer_blocks, col_tiles,
+                               block_k, tile_j);
 }
@@ -3,90 +3,192 @@
 
 typedef uint32_t uint;
 
+// the local indices in a window are stored in 2 or 4 bytes
+#define LOCAL_INDEX(indices, i)                                               \
+    (index_bytes == 2 ? (uint)((uint16_t*)(indices))[i]                      \
+                      : ((uint*)(indices))[i])
+
+uint get_num_vectors();
+
 int main() {
+    bsp_begin();
+
+    // the number of vectors that are multiplied at once, the components of
+    // the vectors in a column are adjacent in v, and so are the partial
+    // sums of a row in u
+    uint k = get_num_vectors();
+
     // we use double buffered mode
     const int double_buffer = 1;
 
-    // there is a single down stream containing the relevant information
+    // the matrix stream contains the relevant information, the vector
+    // stream has a chunk with the local components of v for every strip
     uint* chunk = NULL;
     ebsp_open_down_stream((void**)&chunk, 0);
     ebsp_move_chunk_down((void**)&chunk, 0, double_buffer);
 
-    // the first chunk contains the header
+    float* v_chunk = NULL;
+    ebsp_open_down_stream((void**)&v_chunk, 1);
+
+    // the first chunk contains the header, the sizes of v are the same on
+    // every processor
     //uint max_size_u = chunk[0]; // FIXME obsolete
     uint max_size_v = chunk[1];
     //uint max_size_window = chunk[2]; // FIXME obsolete
     uint max_non_local = chunk[3];
     uint num_strips = chunk[4];
-
-    uint* v = ebsp_malloc((max_size_v + max_non_local) * sizeof(float));
-    uint* u = NULL;
-    ebsp_open_up_stream((void**)&u, 1);
-
-    bsp_push_reg(v, sizeof(uint) * max_non_local + max_size_v);
+    uint index_bytes = chunk[5];
+    // 0: the windows hold triplets, 1: the windows are in CSR format
+    uint csr = chunk[6];
+
+    // two buffers that hold the local components of v in a strip, followed
+    // by the non-local components that its windows need. Strips in which
+    // components are fetched use the buffers in turn, so that a buffer is
+    // only overwritten after everyone passed the next barrier.
+    uint v_stride = (max_size_v + max_non_local) * k;
+    float* v_buffers = ebsp_malloc(2 * v_stride * sizeof(float));
+    uint fetch_strips = 0;
+
+    float* u = NULL;
+    ebsp_open_up_stream((void**)&u, 2);
+
+    bsp_push_reg(v_buffers, 2 * v_stride * sizeof(float));
     bsp_sync();
 
     for (uint strip = 0; strip < num_strips; ++strip) {
-        // next chunk contains strip header
+        // next chunk contains strip header, it is followed by the windows
+        // in which this processor has nonzeros
         ebsp_move_chunk_down((void**)&chunk, 0, double_buffer);
         uint num_windows = chunk[0];
         uint num_local_v = chunk[1];
+        uint fetch = chunk[2];
 
-        // we copy the strip v's to the proper location
-        ebsp_memcpy(v, (uint*)&chunk[2], sizeof(uint) * num_local_v);
+        ebsp_move_chunk_down((void**)&v_chunk, 1, double_buffer);
+
+        // without non-local components the vector chunk is used directly
+        float* v = v_chunk;
+        uint v_offset = 0;
+        if (fetch) {
+            v_offset = (fetch_strips % 2) * v_stride;
+            v = v_buffers + v_offset;
+            ++fetch_strips;
+            ebsp_memcpy(v, v_chunk, sizeof(float) * num_local_v * k);
+
+            // the other processors may only read our part of the strip once
+            // it has been copied
+            ebsp_barrier();
+
+            // obtain the non-local v's of the strip once, a run of
+            // components is fetched from the strip of its owner in a single
+            // transfer. The runs follow the window indices in the header.
+            uint num_runs = chunk[3];
+            uint* run_owners = &chunk[4 + num_windows];
+            uint* run_starts = run_owners + num_runs;
+            uint* run_lengths = run_starts + num_runs;
+
+            uint position = num_local_v * k;
+            for (uint run = 0; run < num_runs; ++run) {
+                bsp_hpget(run_owners[run], v_buffers,
+                          (v_offset + run_starts[run] * k) * sizeof(float),
+                          &v[position], run_lengths[run] * k * sizeof(float));
+                position += run_lengths[run] * k;
+            }
+        }
 
-        // next follow a number of window chunks
         for (uint window = 0; window < num_windows; ++window) {
             ebsp_move_chunk_down((void**)&chunk, 0, double_buffer);
 
             // we maintain the current location in the window chunk
             uint cursor = 0;
 
-            uint num_non_local = chunk[cursor++];
-
-            uint* non_local_owners = &chunk[cursor];
-            cursor += num_non_local;
-
-            uint* non_local_idxs = &chunk[cursor];
-            cursor += num_non_local;
-
-            // obtain non local v's
-            for (uint idx = 0; idx < num_non_local; ++idx) {
-                // we obtain v[num_local_v + idx] from non_local_owners[idx]
-                // at non_local_idxs[idx]
-                bsp_hpget(non_local_owners[idx], v, non_local_idxs[idx],
-                          &v[num_local_v + idx], sizeof(float));
-            }
-            ebsp_barrier();
-
             uint size_u = chunk[cursor++];
             uint window_size = chunk[cursor++];
 
-            uint* triplet_rows = &chunk[cursor];
-            cursor += window_size;
+            // in CSR format there is a row pointer for every local row
+            uint row_entries = csr ? size_u + 1 : window_size;
 
-            uint* triplet_cols = &chunk[cursor];
-            cursor += window_size;
+            uint8_t* triplet_rows = (uint8_t*)&chunk[cursor];
+            uint8_t* triplet_cols = triplet_rows + row_entries * index_bytes;
+            cursor += ((row_entries + window_size) * index_bytes + 3) / 4;
 
             float* triplet_vals = (float*)&chunk[cursor];
 
             // we compute the products
-            for (uint idx = 0; idx < window_size; ++idx) {
-                u[triplet_rows[idx]] = v[triplet_cols[idx]] * triplet_vals[idx];
+            if (k > 1) {
+                // every nonzero is applied to the k vectors
+                for (uint i = 0; i < size_u * k; ++i)
+                    u[i] = 0.0f;
+                uint row = 0;
+                for (uint idx = 0; idx < window_size; ++idx) {
+                    // in CSR format the nonzeros of a row are consecutive
+                    if (csr) {
+                        while (LOCAL_INDEX(triplet_rows, row + 1) <= idx)
+                            ++row;
+                    } else {
+                        row = LOCAL_INDEX(triplet_rows, idx);
+                    }
+                    float* u_row = &u[row * k];
+                    float* v_col = &v[LOCAL_INDEX(triplet_cols, idx) * k];
+                    float value = triplet_vals[idx];
+                    for (uint j = 0; j < k; ++j)
+                        u_row[j] += v_col[j] * value;
+                }
+            } else if (csr) {
+                // a row is summed in a register, and written once
+                for (uint row = 0; row < size_u; ++row) {
+                    uint end = LOCAL_INDEX(triplet_rows, row + 1);
+                    float sum = 0.0f;
+                    for (uint idx = LOCAL_INDEX(triplet_rows, row); idx < end;
+                         ++idx)
+                        sum += v[LOCAL_INDEX(triplet_cols, idx)] *
+                               triplet_vals[idx];
+                    u[row] = sum;
+                }
+            } else {
+                // the up buffer still holds an older window
+                for (uint row = 0; row < size_u; ++row)
+                    u[row] = 0.0f;
+                for (uint idx = 0; idx < window_size; ++idx) {
+                    u[LOCAL_INDEX(triplet_rows, idx)] +=
+                        v[LOCAL_INDEX(triplet_cols, idx)] * triplet_vals[idx];
+                }
             }
 
-            // send result up
-            ebsp_set_up_chunk_size(1, sizeof(uint) * size_u);
-            ebsp_move_chunk_up((void**)&u, 1, double_buffer);
+            // send the partial sums of this window up, the host adds the
+            // contributions of the strips
+            ebsp_set_up_chunk_size(2, sizeof(float) * size_u * k);
+            ebsp_move_chunk_up((void**)&u, 2, double_buffer);
         }
-
     }
 
+    // other processors may still be reading our part of the last strip
+    if (fetch_strips > 0)
+        ebsp_barrier();
+
     // we close the down stream
     ebsp_close_down_stream(0);
-    ebsp_close_up_stream(1);
+    ebsp_close_down_stream(1);
+    ebsp_close_up_stream(2);
+
+    ebsp_free(v_buffers);
 
-    ebsp_free(v);
+    bsp_end();
 
     return 0;
 }
+
+uint get_num_vectors() {
+    int packets = 0;
+    int accum_bytes = 0;
+    int status = 0;
+    int tag = 0;
+    uint k = 1;
+
+    bsp_qsize(&packets, &accum_bytes);
+    for (int i = 0; i < packets; ++i) {
+        bsp_get_tag(&status, &tag);
+        if (tag == 0)
+            bsp_move(&k, sizeof(uint));
+    }
+    return k;
+}
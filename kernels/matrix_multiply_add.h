@@ -0,0 +1,72 @@
+#pragma once
+
+// The multiply-add of the inner blocks of Cannon's algorithm. It is plain
+// C99 so that it compiles for the Epiphany cores as well as natively, see
+// benchmarks/micro_kernel.cpp.
+
+#ifdef __cplusplus
+#define MMA_RESTRICT __restrict__
+#else
+#define MMA_RESTRICT restrict
+#endif
+
+// C[0:4, 0:4] += A[0:4, :] B[:, 0:4] for row major blocks with n columns.
+// The 4 x 4 tile of C is kept in registers, and every step of k loads four
+// elements of A and of B for sixteen fused multiply-adds.
+static inline void multiply_add_tile(const float* MMA_RESTRICT A,
+                                     const float* MMA_RESTRICT B,
+                                     float* MMA_RESTRICT C, int n) {
+    float c00 = C[0], c01 = C[1], c02 = C[2], c03 = C[3];
+    float c10 = C[n], c11 = C[n + 1], c12 = C[n + 2], c13 = C[n + 3];
+    float c20 = C[2 * n], c21 = C[2 * n + 1], c22 = C[2 * n + 2],
+          c23 = C[2 * n + 3];
+    float c30 = C[3 * n], c31 = C[3 * n + 1], c32 = C[3 * n + 2],
+          c33 = C[3 * n + 3];
+
+    for (int k = 0; k < n; ++k) {
+        const float a0 = A[k];
+        const float a1 = A[n + k];
+        const float a2 = A[2 * n + k];
+        const float a3 = A[3 * n + k];
+        const float* b = B + k * n;
+        const float b0 = b[0];
+        const float b1 = b[1];
+        const float b2 = b[2];
+        const float b3 = b[3];
+
+        c00 += a0 * b0; c01 += a0 * b1; c02 += a0 * b2; c03 += a0 * b3;
+        c10 += a1 * b0; c11 += a1 * b1; c12 += a1 * b2; c13 += a1 * b3;
+        c20 += a2 * b0; c21 += a2 * b1; c22 += a2 * b2; c23 += a2 * b3;
+        c30 += a3 * b0; c31 += a3 * b1; c32 += a3 * b2; c33 += a3 * b3;
+    }
+
+    C[0] = c00; C[1] = c01; C[2] = c02; C[3] = c03;
+    C[n] = c10; C[n + 1] = c11; C[n + 2] = c12; C[n + 3] = c13;
+    C[2 * n] = c20; C[2 * n + 1] = c21; C[2 * n + 2] = c22;
+    C[2 * n + 3] = c23;
+    C[3 * n] = c30; C[3 * n + 1] = c31; C[3 * n + 2] = c32;
+    C[3 * n + 3] = c33;
+}
+
+// C += A B for row major n x n blocks. The part of C that is covered by 4 x 4
+// tiles is computed tile by tile, the remaining rows and columns when n is
+// not a multiple of four one element at a time.
+static inline void matrix_multiply_add(const float* MMA_RESTRICT A,
+                                       const float* MMA_RESTRICT B,
+                                       float* MMA_RESTRICT C, int n) {
+    const int tiled = n - n % 4;
+
+    for (int i = 0; i < tiled; i += 4)
+        for (int j = 0; j < tiled; j += 4)
+            multiply_add_tile(A + i * n, B + j, C + i * n + j, n);
+
+    for (int i = 0; i < n; ++i) {
+        // the columns to the right of the tiles, and complete rows below them
+        for (int j = (i < tiled) ? tiled : 0; j < n; ++j) {
+            float sum = C[i * n + j];
+            for (int k = 0; k < n; ++k)
+                sum += A[i * n + k] * B[k * n + j];
+            C[i * n + j] = sum;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#include "catch.hpp"
+
+extern "C" {
+#include <host_bsp.h>
+}
+
+#include <array>
+#include <vector>
+
+// These tests only use the host_bsp interface, so that they also run on the
+// device. The layout of the streams is written out by hand, the way Cannon's
+// algorithm expects it: processor (s, t) starts with the inner blocks
+// A_{s, -(s + t)} and B_{-(s + t), t}, indices taken modulo N.
+TEST_CASE("k_cannon computes a product on a single outer block", "[emulator]") {
+    const int N = 4;
+    const int b = 3;
+    const int n = N * b;
+
+    std::vector<float> A(n * n);
+    std::vector<float> B(n * n);
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            A[i * n + j] = (float)((i * 7 + j * 3) % 11) - 5.0f;
+            B[i * n + j] = (float)((i * 5 + j * 2) % 13) - 6.0f;
+        }
+    }
+
+    std::array<std::vector<float>, N * N> lhs;
+    std::array<std::vector<float>, N * N> rhs;
+    for (int s = 0; s < N; ++s) {
+        for (int t = 0; t < N; ++t) {
+            int k = (2 * N - s - t) % N;
+            for (int i = 0; i < b; ++i) {
+                for (int j = 0; j < b; ++j) {
+                    lhs[s * N + t].push_back(A[(s * b + i) * n + k * b + j]);
+                    rhs[s * N + t].push_back(B[(k * b + i) * n + t * b + j]);
+                }
+            }
+        }
+    }
+
+    REQUIRE(bsp_init("kernels/k_cannon.srec", 0, 0));
+    REQUIRE(bsp_begin(N * N));
+
+    const int blockBytes = b * b * sizeof(float);
+    std::array<float*, N * N> result;
+    for (int s = 0; s < N * N; ++s) {
+        ebsp_create_down_stream(lhs[s].data(), s, blockBytes, blockBytes);
+        ebsp_create_down_stream(rhs[s].data(), s, blockBytes, blockBytes);
+        result[s] = (float*)ebsp_create_up_stream(s, blockBytes, blockBytes);
+    }
+
+    int tagsize = sizeof(int);
+    ebsp_set_tagsize(&tagsize);
+    std::array<int, 3> parameters = {b, 1, N};
+    for (int s = 0; s < N * N; ++s) {
+        for (int tag = 0; tag < 3; ++tag) {
+            ebsp_send_down(s, &tag, &parameters[tag], sizeof(int));
+        }
+    }
+
+    ebsp_spmd();
+
+    for (int s = 0; s < N; ++s) {
+        for (int t = 0; t < N; ++t) {
+            for (int i = 0; i < b; ++i) {
+                for (int j = 0; j < b; ++j) {
+                    float expected = 0.0f;
+                    for (int k = 0; k < n; ++k)
+                        expected += A[(s * b + i) * n + k] *
+                                    B[k * n + t * b + j];
+                    CAPTURE(s);
+                    CAPTURE(t);
+                    CHECK(result[s * N + t][i * b + j] == expected);
+                }
+            }
+        }
+    }
+
+#ifdef EBSP_EMULATOR
+    auto stats = ebsp_emu_get_statistics();
+    CHECK(stats.chunks_down == 2 * N * N);
+    CHECK(stats.chunks_up == N * N);
+    CHECK(stats.dma_transfers == 2 * (N - 1) * N * N);
+    // a barrier for every shift, there is no next chunk to prefetch so the
+    // streams are single buffered, and C is double buffered
+    CHECK(stats.barriers == N * N * N);
+    CHECK(stats.chunks_prefetched == 0);
+    CHECK(stats.peak_local_bytes == 6 * blockBytes);
+#endif
+
+    bsp_end();
+}
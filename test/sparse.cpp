@@ -0,0 +1,559 @@
+#include "catch.hpp"
+
+#include <zephany.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace Zephany;
+
+using TIdx = uint32_t;
+using TVal = float;
+using TMatrix = DStreamingSparseMatrix<TVal, TIdx>;
+using TVector = DStreamingVector<TVal, TIdx>;
+
+namespace {
+
+// The chunks of a raw stream
+std::vector<std::vector<uint32_t>> chunksOf(const char* data,
+                                            std::size_t size) {
+    std::vector<std::vector<uint32_t>> chunks;
+    std::size_t offset = 0;
+    while (offset < size) {
+        int size = 0;
+        std::memcpy(&size, &data[offset], sizeof(int));
+        offset += sizeof(int);
+        chunks.emplace_back(size / sizeof(uint32_t));
+        std::memcpy(chunks.back().data(), &data[offset], size);
+        offset += size;
+    }
+    return chunks;
+}
+
+TVal asValue(uint32_t word) {
+    TVal value;
+    std::memcpy(&value, &word, sizeof(TVal));
+    return value;
+}
+
+bool sameStreams(const SparseStream<TMatrix, TVector>& lhs,
+                 const SparseStream<TMatrix, TVector>& rhs) {
+    for (TIdx s = 0; s < stream_config::processors; ++s) {
+        if (lhs.getRawStreamSize(s) != rhs.getRawStreamSize(s) ||
+            !std::equal(lhs.getRawStream(s),
+                        lhs.getRawStream(s) + lhs.getRawStreamSize(s),
+                        rhs.getRawStream(s)) ||
+            lhs.getWindowSizeU()[s] != rhs.getWindowSizeU()[s] ||
+            lhs.getUpIndices()[s] != rhs.getUpIndices()[s] ||
+            lhs.upStreamSize(s) != rhs.upStreamSize(s) ||
+            lhs.getVectorStream(s) != rhs.getVectorStream(s))
+            return false;
+    }
+    return true;
+}
+
+const TIdx rows = 90;
+const TIdx cols = 70;
+const TIdx stripSize = 20;
+const TIdx windowSize = 25;
+
+// A random matrix with randomly distributed nonzeros and vector, v_j = j + 1
+std::vector<TVal> randomProblem(TMatrix& A, TVector& v) {
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<TIdx> row(0, rows - 1);
+    std::uniform_int_distribution<TIdx> col(0, cols - 1);
+    std::uniform_int_distribution<TIdx> proc(0, stream_config::processors - 1);
+
+    std::vector<std::unique_ptr<TMatrix::image_type>> images;
+    for (TIdx s = 0; s < stream_config::processors; ++s)
+        images.emplace_back(new TMatrix::image_type());
+
+    std::vector<TVal> expected(rows, 0.0f);
+    for (TIdx k = 0; k < 600; ++k) {
+        Triplet<TVal, TIdx> triplet(row(generator), col(generator),
+                                    (TVal)(k % 7 + 1));
+        expected[triplet.row()] += triplet.value() * (TVal)(triplet.col() + 1);
+        images[proc(generator)]->pushTriplet(triplet);
+    }
+    A.resetImages(images);
+
+    for (TIdx j = 0; j < cols; ++j) {
+        v.at(j) = (TVal)(j + 1);
+        v.reassign(j, proc(generator));
+    }
+
+    return expected;
+}
+
+// Compute A v from the streams, in the way the kernel does
+std::vector<TVal> decodeProduct(const SparseStream<TMatrix, TVector>& stream) {
+    const TIdx strips = (cols - 1) / stripSize + 1;
+    const TIdx windows = (rows - 1) / windowSize + 1;
+
+    // the vector streams are needed to look up non-local components
+    std::array<std::vector<std::vector<uint32_t>>, stream_config::processors>
+        chunks;
+    std::array<std::vector<std::vector<TVal>>, stream_config::processors>
+        stripV;
+    // the chunk of the header of every strip
+    std::array<std::vector<std::size_t>, stream_config::processors>
+        stripHeaders;
+    std::vector<uint32_t> fetches;
+    for (TIdx s = 0; s < stream_config::processors; ++s) {
+        chunks[s] = chunksOf(stream.getRawStream(s),
+                             stream.getRawStreamSize(s));
+        CHECK(chunks[s][0][4] == strips);
+
+        auto& vector = stream.getVectorStream(s);
+        auto vectorChunks = chunksOf(vector.data(), vector.size());
+        REQUIRE(vectorChunks.size() == strips);
+
+        std::size_t position = 1;
+        for (TIdx strip = 0; strip < strips; ++strip) {
+            REQUIRE(position < chunks[s].size());
+            stripHeaders[s].push_back(position);
+            auto& header = chunks[s][position];
+            REQUIRE(header.size() >= 4);
+            REQUIRE(header.size() == 4 + header[0] + 3 * header[3]);
+            CHECK(header[0] <= windows);
+            CHECK(header[1] <= chunks[s][0][1]);
+            REQUIRE(header[1] <= vectorChunks[strip].size());
+            position += 1 + header[0];
+
+            // the synchronisation is the same on every processor
+            if (s == 0)
+                fetches.push_back(header[2]);
+            CHECK(fetches[strip] == header[2]);
+
+            stripV[s].emplace_back();
+            for (TIdx i = 0; i < header[1]; ++i)
+                stripV[s].back().push_back(asValue(vectorChunks[strip][i]));
+        }
+        REQUIRE(position == chunks[s].size());
+    }
+
+    std::vector<TVal> u(rows, 0.0f);
+    for (TIdx s = 0; s < stream_config::processors; ++s) {
+        // the rows of the windows follow each other in the up indices
+        const auto& upIndices = stream.getUpIndices()[s];
+        std::size_t upOffset = 0;
+        for (TIdx strip = 0; strip < strips; ++strip) {
+            const std::size_t position = stripHeaders[s][strip];
+            auto& header = chunks[s][position];
+
+            // the empty windows are left out
+            std::vector<bool> listed(windows, false);
+            for (TIdx w = 0; w < header[0]; ++w) {
+                REQUIRE(header[4 + w] < windows);
+                if (w > 0)
+                    CHECK(header[4 + w] > header[3 + w]);
+                listed[header[4 + w]] = true;
+            }
+            for (TIdx window = 0; window < windows; ++window)
+                CHECK((stream.getWindowSizeU()[s][strip * windows + window] >
+                       0) == listed[window]);
+
+            // the non-local components are fetched once for the strip
+            std::vector<TVal> windowV = stripV[s][strip];
+            const TIdx runs = header[3];
+            const std::size_t runsBegin = 4 + header[0];
+            if (runs > 0)
+                CHECK(header[2] == 1);
+            for (TIdx r = 0; r < runs; ++r) {
+                TIdx owner = header[runsBegin + r];
+                TIdx start = header[runsBegin + runs + r];
+                TIdx length = header[runsBegin + 2 * runs + r];
+                REQUIRE(owner < stream_config::processors);
+                REQUIRE(length > 0);
+                REQUIRE(start + length <= stripV[owner][strip].size());
+                if (r > 0)
+                    CHECK(owner >= header[runsBegin + r - 1]);
+                for (TIdx i = start; i < start + length; ++i)
+                    windowV.push_back(stripV[owner][strip][i]);
+            }
+            CHECK(windowV.size() - stripV[s][strip].size() <=
+                  chunks[s][0][3]);
+
+            for (TIdx w = 0; w < header[0]; ++w) {
+                const TIdx window = header[4 + w];
+                auto& chunk = chunks[s][position + 1 + w];
+                std::size_t cursor = 0;
+
+                TIdx sizeU = chunk[cursor++];
+                TIdx size = chunk[cursor++];
+                TIdx windowIdx = strip * windows + window;
+                REQUIRE(stream.getWindowSizeU()[s][windowIdx] == sizeU);
+                REQUIRE(upOffset + sizeU <= upIndices.size());
+
+                // the local indices take two or four bytes
+                const TIdx indexBytes = chunks[s][0][5];
+                const bool csr = chunks[s][0][6] == 1;
+                auto bytes = (const char*)&chunk[cursor];
+                auto index = [&](std::size_t i) -> TIdx {
+                    if (indexBytes == sizeof(uint16_t)) {
+                        uint16_t result;
+                        memcpy(&result, bytes + i * indexBytes, indexBytes);
+                        return result;
+                    }
+                    uint32_t result;
+                    memcpy(&result, bytes + i * indexBytes, indexBytes);
+                    return result;
+                };
+                const TIdx rowEntries = csr ? sizeU + 1 : size;
+                cursor += ((rowEntries + size) * indexBytes + 3) / 4;
+                REQUIRE(chunk.size() == cursor + size);
+
+                std::vector<TIdx> localRows;
+                for (TIdx i = 0; i < rowEntries; ++i) {
+                    if (!csr) {
+                        localRows.push_back(index(i));
+                    } else if (i < sizeU) {
+                        REQUIRE(index(i) < index(i + 1));
+                        localRows.insert(localRows.end(),
+                                         index(i + 1) - index(i), i);
+                    }
+                }
+                REQUIRE(localRows.size() == size);
+
+                for (TIdx k = 0; k < size; ++k) {
+                    TIdx localRow = localRows[k];
+                    TIdx localCol = index(rowEntries + k);
+                    TVal value = asValue(chunk[cursor + k]);
+                    REQUIRE(localRow < sizeU);
+                    REQUIRE(localCol < windowV.size());
+                    u[upIndices[upOffset + localRow]] += value * windowV[localCol];
+                }
+                upOffset += sizeU;
+            }
+        }
+        CHECK(upOffset == upIndices.size());
+    }
+
+    return u;
+}
+
+} // namespace
+
+TEST_CASE("the sparse stream reproduces the product", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    // the streams are built in parallel, but the bytes do not depend on the
+    // number of threads
+    ThreadPool serial(1);
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream(serial);
+
+    ThreadPool parallel(5);
+    SparseStream<TMatrix, TVector> again(A, v, stripSize, windowSize);
+    again.prepareStream(parallel);
+    CHECK(sameStreams(stream, again));
+
+    auto u = decodeProduct(stream);
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expected[i]));
+
+    // a new vector only changes the vector stream
+    TVector x(cols, 1.0);
+    for (TIdx j = 0; j < cols; ++j) {
+        x.at(j) = (TVal)(j % 3);
+        x.reassign(j, v.getOwners()[j]);
+    }
+    std::vector<TVal> expectedX(rows, 0.0f);
+    for (const auto& image : A.getImages())
+        for (const auto& triplet : *image)
+            expectedX[triplet.row()] += triplet.value() * x[triplet.col()];
+
+    stream.updateVector(x);
+    u = decodeProduct(stream);
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expectedX[i]));
+}
+
+TEST_CASE("sparse windows can use compact indices and the CSR layout",
+          "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    SparseStream<TMatrix, TVector> compact(A, v, stripSize, windowSize);
+    CHECK(compact.localIndexBytes() == sizeof(uint16_t));
+    compact.prepareStream();
+
+    SparseStream<TMatrix, TVector> wide(A, v, stripSize, windowSize);
+    wide.setCompactIndices(false);
+    CHECK(wide.localIndexBytes() == sizeof(TIdx));
+    wide.prepareStream();
+
+    SparseStream<TMatrix, TVector> csr(A, v, stripSize, windowSize);
+    csr.setLayout(window_layout::csr);
+    CHECK(csr.localIndexBytes() == sizeof(uint16_t));
+    csr.prepareStream();
+
+    // the row pointers of large windows do not fit in 16 bits
+    SparseStream<TMatrix, TVector> large(A, v, 300, 300);
+    large.setLayout(window_layout::csr);
+    CHECK(large.localIndexBytes() == sizeof(TIdx));
+
+    for (auto stream : {&compact, &wide, &csr}) {
+        auto u = decodeProduct(*stream);
+        for (TIdx i = 0; i < rows; ++i)
+            CHECK(u[i] == Approx(expected[i]));
+    }
+
+    // a window has no more rows than nonzeros, up to the row pointer and
+    // the padding
+    const TIdx windowCount = ((cols - 1) / stripSize + 1) *
+                             ((rows - 1) / windowSize + 1);
+    for (TIdx s = 0; s < stream_config::processors; ++s) {
+        CHECK(compact.getRawStreamSize(s) < wide.getRawStreamSize(s));
+        CHECK(csr.getRawStreamSize(s) <=
+              compact.getRawStreamSize(s) + 4 * windowCount);
+    }
+}
+
+TEST_CASE("prepared sparse streams are cached on disk", "[sparse]") {
+    char directory[] = "/tmp/zephany_cacheXXXXXX";
+    REQUIRE(mkdtemp(directory) != nullptr);
+
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    randomProblem(A, v);
+
+    SparseStream<TMatrix, TVector> reference(A, v, stripSize, windowSize);
+    reference.prepareStream();
+
+    SparseStream<TMatrix, TVector> first(A, v, stripSize, windowSize);
+    CHECK(!first.load(std::string(directory) + "/missing.bin"));
+    first.prepareStream(directory);
+    CHECK(sameStreams(reference, first));
+
+    SparseStream<TMatrix, TVector> cached(A, v, stripSize, windowSize);
+    char name[64];
+    snprintf(name, sizeof(name), "/sparse_%016llx.bin",
+             (unsigned long long)cached.cacheKey());
+    CHECK(cached.load(directory + std::string(name)));
+    CHECK(sameStreams(reference, cached));
+
+    // a different stream does not accept the file
+    SparseStream<TMatrix, TVector> other(A, v, stripSize, windowSize + 1);
+    CHECK(other.cacheKey() != cached.cacheKey());
+    CHECK(!other.load(directory + std::string(name)));
+
+    std::remove((directory + std::string(name)).c_str());
+    rmdir(directory);
+}
+
+TEST_CASE("non-local components are fetched in runs", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    // with a block distribution of v the fetched components are adjacent
+    for (TIdx j = 0; j < cols; ++j)
+        v.reassign(j, (j / 4) % stream_config::processors);
+
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream();
+    auto statistics = stream.getFetchStatistics();
+    CHECK(statistics.runs < statistics.components);
+    CHECK(statistics.averageRunLength() > 1.0);
+    // a component is fetched at most once per processor
+    CHECK(statistics.components <= stream_config::processors * cols);
+
+    auto u = decodeProduct(stream);
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expected[i]));
+
+    setVerification(true);
+    TVector w(rows);
+    w = A * v;
+    setVerification(false);
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(w[i] == Approx(expected[i]));
+}
+
+TEST_CASE("sparse matrix vector products run on the device", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream();
+    REQUIRE(A.hasStream());
+
+    setVerification(true);
+
+    TVector u(rows);
+    u = A * v;
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expected[i]));
+
+    // the partial sums of the strips are added on the host
+    CHECK(host::verifySpMV(A, v, u) == 0);
+    u.at(0) += 1.0f;
+    CHECK(host::verifySpMV(A, v, u) == 1);
+
+    // the CSR layout gives the same product
+    SparseStream<TMatrix, TVector> csr(A, v, stripSize, windowSize);
+    csr.setLayout(window_layout::csr);
+    csr.prepareStream();
+    u = A * v;
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expected[i]));
+
+    setVerification(false);
+
+    // and so does the host backend
+    setBackend(execution_backend::host);
+    TVector w(rows);
+    w = A * v;
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(w[i] == Approx(expected[i]));
+    setBackend(execution_backend::device);
+
+    Session::instance().end();
+}
+
+TEST_CASE("the host stand-in reproduces the product", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    for (auto layout : {window_layout::triplets, window_layout::csr}) {
+        SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+        stream.setLayout(layout);
+        stream.prepareStream();
+
+        TVector u(rows, 1.0);
+        host::spmvStream(stream, u);
+        for (TIdx i = 0; i < rows; ++i)
+            CHECK(u[i] == Approx(expected[i]));
+    }
+}
+
+TEST_CASE("strip and window sizes are tuned", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    auto expected = randomProblem(A, v);
+
+    SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+    stream.prepareStream();
+
+    SparseStreamTuner<TMatrix, TVector> tuner(A, v);
+    tuner.setSizes({8, 16, 32, 64, 128});
+    auto best = tuner.tune();
+
+    // sizes that are not smaller than the matrix are skipped
+    CHECK(tuner.getCandidates().size() == 4 * 4);
+    CHECK(best.fits);
+    for (const auto& candidate : tuner.getCandidates()) {
+        CHECK(candidate.localMemory > 0);
+        if (candidate.fits)
+            CHECK(best.predicted <= candidate.predicted);
+    }
+
+    // the stream of A is restored
+    REQUIRE(A.hasStream());
+    CHECK(&A.getStream() == &stream);
+
+    // candidates that do not fit are rejected
+    std::size_t smallest = best.localMemory;
+    for (const auto& candidate : tuner.getCandidates())
+        smallest = std::min(smallest, candidate.localMemory);
+    tuner.setLocalMemory(smallest);
+    auto small = tuner.tune();
+    CHECK(small.localMemory == smallest);
+
+    // the best predictions can be timed
+    tuner.setLocalMemory(32 * 1024);
+    tuner.setTiming(tuning_timing::host, 2, 1);
+    auto timed = tuner.tune();
+    std::size_t count = 0;
+    for (const auto& candidate : tuner.getCandidates()) {
+        if (candidate.seconds >= 0.0) {
+            ++count;
+            CHECK(timed.seconds <= candidate.seconds);
+        }
+    }
+    CHECK(count == 2);
+
+    tuner.setTiming(tuning_timing::device, 1, 1);
+    auto device = tuner.tune();
+    CHECK(device.seconds >= 0.0);
+    CHECK(device.stripSize == best.stripSize);
+    CHECK(device.windowSize == best.windowSize);
+
+    TVector u(rows);
+    u = A * v;
+    for (TIdx i = 0; i < rows; ++i)
+        CHECK(u[i] == Approx(expected[i]));
+
+    Session::instance().end();
+}
+
+TEST_CASE("a block of vectors is multiplied at once", "[sparse]") {
+    TMatrix A(rows, cols);
+    TVector v(cols, 1.0);
+    randomProblem(A, v);
+
+    // the vectors are distributed like v, x_j = (j + 1) v + j
+    const TIdx vectors = 3;
+    std::vector<TVector> X;
+    for (TIdx j = 0; j < vectors; ++j) {
+        X.emplace_back(cols, 0.0);
+        for (TIdx i = 0; i < cols; ++i) {
+            X[j].at(i) = (j + 1) * v[i] + j;
+            X[j].reassign(i, v.getOwners()[i]);
+        }
+    }
+
+    std::vector<std::vector<TVal>> expected(vectors);
+    for (TIdx j = 0; j < vectors; ++j) {
+        TVector u(rows);
+        host::spmv(A, X[j], u);
+        for (TIdx i = 0; i < rows; ++i)
+            expected[j].push_back(u[i]);
+    }
+
+    setVerification(true);
+    for (auto layout : {window_layout::triplets, window_layout::csr}) {
+        SparseStream<TMatrix, TVector> stream(A, v, stripSize, windowSize);
+        stream.setLayout(layout);
+        stream.prepareStream();
+        const auto memory = stream.localMemory(0);
+
+        auto U = spmm(A, X);
+        REQUIRE(U.size() == vectors);
+        for (TIdx j = 0; j < vectors; ++j)
+            for (TIdx i = 0; i < rows; ++i)
+                CHECK(U[j][i] == Approx(expected[j][i]));
+
+        // the vector streams hold the components of every vector
+        CHECK(stream.getVectorCount() == vectors);
+        CHECK(stream.localMemory(0, vectors) > memory);
+
+        // the vectors can also be the columns of a tall and skinny matrix
+        DStreamingMatrix<TVal, TIdx> Y(4, cols, vectors);
+        Y.generate([&](TIdx i, TIdx j) { return X[j][i]; });
+        auto V = spmm(A, Y);
+        REQUIRE(V.getRows() == rows);
+        REQUIRE(V.getCols() == vectors);
+        for (TIdx j = 0; j < vectors; ++j)
+            for (TIdx i = 0; i < rows; ++i)
+                CHECK(V.at(i, j) == Approx(expected[j][i]));
+
+        // and a single vector can be multiplied again afterwards
+        TVector u(rows);
+        u = A * X[1];
+        CHECK(stream.getVectorCount() == 1);
+        for (TIdx i = 0; i < rows; ++i)
+            CHECK(u[i] == Approx(expected[1][i]));
+    }
+    setVerification(false);
+
+    Session::instance().end();
+}
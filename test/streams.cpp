@@ -62,7 +62,7 @@ TEST_CASE("simple stream construction and manipulation", "[streams]") {
         }
     }
 
-    SECTION("we can transpose the stream") {
+    SECTION("changing the orientation does not move the data") {
         stream.setOrientation(stream_orientation::right_handed);
         auto& data = stream.getData();
 
@@ -70,19 +70,19 @@ TEST_CASE("simple stream construction and manipulation", "[streams]") {
             CAPTURE(i);
             CHECK(std::equal(firstBlock[i].begin(), firstBlock[i].end(),
                              data[procs[i]].begin()));
-        }
-
-        for (unsigned int i = 0; i < 3; ++i) {
-            CAPTURE(i);
-            CHECK(std::equal(thirdBlock[i].begin(), thirdBlock[i].end(),
-                             data[procs[i]].begin() + l * l));
-        }
-
-        for (unsigned int i = 0; i < 3; ++i) {
-            CAPTURE(i);
             CHECK(std::equal(secondBlock[i].begin(), secondBlock[i].end(),
+                             data[procs[i]].begin() + l * l));
+            CHECK(std::equal(thirdBlock[i].begin(), thirdBlock[i].end(),
                              data[procs[i]].begin() + 2 * l * l));
         }
+
+        // but the stream is created in column major order
+        CHECK(stream.streamedChunk(0) == 0);
+        CHECK(stream.streamedChunk(1) == 2);
+        CHECK(stream.streamedChunk(2) == 1);
+        CHECK(stream.streamedChunk(3) == 3);
+
+        CHECK(matrix.at(2, 9) == 41.0f);
     }
 }
 
@@ -96,13 +96,55 @@ void testMatrix(TIdx size) {
             A.at(i, j) = (float)i;
             B.at(i, j) = (float)j;
         }
-    B.getStream().setOrientation(stream_orientation::right_handed);
 
     DStreamingMatrix<TVal, TIdx> C(blockSize, size);
     C = A * B;
     REQUIRE(C.at(1, 1) == size);
 }
 
+/* Multiply an m x k matrix A by a k x n matrix B, and check the elements of
+ * C = A B in every `stride`-th row and column. The operands are streamed
+ * with the given orientations, and the product is computed `products` times
+ * from the same operands. */
+void testProduct(TIdx blockSize, TIdx m, TIdx k, TIdx n, TIdx stride = 1,
+                 stream_orientation lhsOrientation =
+                     stream_orientation::left_handed,
+                 stream_orientation rhsOrientation =
+                     stream_orientation::left_handed,
+                 int products = 1) {
+    CAPTURE(blockSize);
+    CAPTURE(m);
+    CAPTURE(k);
+    CAPTURE(n);
+
+    DStreamingMatrix<TVal, TIdx> A(blockSize, m, k);
+    DStreamingMatrix<TVal, TIdx> B(blockSize, k, n);
+    auto a = [](TIdx i, TIdx j) { return (float)((i * 7 + j * 3) % 11); };
+    auto b = [](TIdx i, TIdx j) { return (float)((i * 5 + j * 2) % 13); };
+    A.generate(a);
+    B.generate(b);
+    A.getStream().setOrientation(lhsOrientation);
+    B.getStream().setOrientation(rhsOrientation);
+
+    for (int product = 0; product < products; ++product) {
+        CAPTURE(product);
+        DStreamingMatrix<TVal, TIdx> C(blockSize, m, n);
+        C = A * B;
+        REQUIRE(C.getRows() == m);
+        REQUIRE(C.getCols() == n);
+
+        std::vector<TVal> result;
+        C.extract(result);
+        for (TIdx i = 0; i < m; i += stride)
+            for (TIdx j = 0; j < n; j += stride) {
+                TVal expected = 0.0f;
+                for (TIdx l = 0; l < k; ++l)
+                    expected += a(i, l) * b(l, j);
+                CHECK(result[i * n + j] == expected);
+            }
+    }
+}
+
 TEST_CASE("matrices of different sizes", "[streams]") {
     std::vector<TIdx> sizes = {16, 17, 32, 33, 64, 100, 128};
     for (auto size : sizes) {
@@ -110,23 +152,376 @@ TEST_CASE("matrices of different sizes", "[streams]") {
     }
 }
 
+TEST_CASE("streamed products are correct for general matrices",
+          "[streams]") {
+    std::vector<std::array<TIdx, 2>> shapes = {{{2, 8}}, {{4, 16}}};
+    for (auto shape : shapes)
+        testProduct(shape[0], shape[1], shape[1], shape[1]);
+}
+
+TEST_CASE("Cannon kernels are compiled for fixed inner block sizes",
+          "[streams]") {
+    CHECK(detail::cannonKernel(16) == "kernels/k_cannon_16.srec");
+    CHECK(detail::cannonKernel(25) == "kernels/k_cannon.srec");
+    CHECK(detail::cannonKernel(32) == "kernels/k_cannon.srec");
+    CHECK(detail::cannonKernelBlockSize("kernels/k_cannon_16.srec") == 16);
+    CHECK(detail::cannonKernelBlockSize("kernels/k_cannon.srec") == 0);
+
+    // the specialised and generic kernels give the same products
+    for (TIdx blockSize : {8, 12, 16, 24, 27}) {
+        TIdx size = 2 * blockSize * stream_config::N;
+        testProduct(blockSize, size, size, size, 5);
+    }
+}
+
+TEST_CASE("the tiled Cannon schedule streams fewer bytes", "[streams]") {
+    // four outer blocks, which fit in tiles of two by two for inner blocks
+    // of size 16 and four by four for inner blocks of size 8
+    auto plan = planCannon<TVal>(16, 4, cannon_schedule::tiles);
+    CHECK(plan.tileRows == 2);
+    CHECK(plan.tileCols == 2);
+    CHECK(planCannon<TVal>(8, 4, cannon_schedule::tiles).tileRows == 4);
+    CHECK(planCannon<TVal>(32, 4, cannon_schedule::tiles).tileRows == 1);
+    auto reference = planCannon<TVal>(16, 4, cannon_schedule::outer_blocks);
+    CHECK(reference.tileRows == 1);
+    CHECK(reference.tileCols == 1);
+    CHECK(reference.localMemory == 8 * 16 * 16 * sizeof(TVal));
+    CHECK(plan.bytesDown * 2 == reference.bytesDown);
+    CHECK(plan.bytesUp == reference.bytesUp);
+
+    TIdx blockSize = 16;
+    TIdx size = 4 * blockSize * stream_config::N;
+    for (auto schedule :
+         {cannon_schedule::outer_blocks, cannon_schedule::tiles}) {
+        for (auto orientation : {stream_orientation::left_handed,
+                                 stream_orientation::right_handed}) {
+            CAPTURE((int)schedule);
+            CAPTURE((int)orientation);
+            setCannonSchedule(schedule);
+            testProduct(blockSize, size, size, size, 5, orientation,
+                        orientation);
+
+#ifdef EBSP_EMULATOR
+            auto expected = planCannon<TVal>(blockSize, 4, schedule);
+            auto statistics = ebsp_emu_get_statistics();
+            CHECK(statistics.bytes_down == expected.bytesDown);
+            CHECK(statistics.bytes_up == expected.bytesUp);
+            // an operand whose panels are never streamed in order is moved
+            // single buffered, the other one prefetches its next panel
+            CHECK(statistics.peak_local_bytes < expected.localMemory);
+            CHECK(statistics.chunks_prefetched > 0);
+            if (schedule == cannon_schedule::outer_blocks) {
+                // one of the operands is streamed in order of its panels
+                // along the inner dimension, and the cursor is moved back
+                // after the last of these for every outer block of C, but
+                // not after the last outer block of a row or column of C
+                CHECK(statistics.chunks_prefetched ==
+                      (4 * 4 * 3 + 3) * stream_config::processors);
+            }
+#endif
+        }
+    }
+
+    setCannonSchedule(cannon_schedule::tiles);
+}
+
+TEST_CASE("tiles that do not divide the outer blocks are padded",
+          "[streams]") {
+    // five outer blocks are not divided by any tile but 1 x 1 and 1 x 5,
+    // so the tile of 1 x 3 is padded to six outer blocks
+    auto plan = planCannon<TVal>(16, 5, cannon_schedule::tiles);
+    CHECK(plan.tileRows * plan.tileCols == 3);
+    CHECK(plan.paddedRows * plan.paddedCols == 30);
+    CHECK(plan.bytesDown <
+          planCannon<TVal>(16, 5, cannon_schedule::outer_blocks).bytesDown);
+
+    TIdx blockSize = 16;
+    TIdx size = 5 * blockSize * stream_config::N - 3;
+    auto& session = Session::instance();
+    session.end();
+    session.resetStatistics();
+    testProduct(blockSize, size, size, size, 5,
+                stream_orientation::left_handed,
+                stream_orientation::left_handed, 2);
+
+#ifdef EBSP_EMULATOR
+    auto statistics = ebsp_emu_get_statistics();
+    CHECK(statistics.bytes_down == plan.bytesDown);
+    CHECK(statistics.bytes_up == plan.bytesUp);
+#endif
+
+    // the panels of the operand with tiles of three outer blocks are gathered
+    // once, and the second product does not write them to external memory
+    CHECK(session.getStatistics().streamsUnchanged ==
+          stream_config::processors);
+
+    session.end();
+}
+
+TEST_CASE("rectangular matrices are multiplied without padding them",
+          "[streams]") {
+    // a tall and narrow C has tiles that span all of its columns
+    auto plan = planCannon<TVal>(8, 4, 2, 1, cannon_schedule::tiles);
+    CHECK(plan.tileRows == 4);
+    CHECK(plan.tileCols == 1);
+    CHECK(plan.bytesDown == stream_config::processors * 2 * 5 * 8 * 8 *
+                                sizeof(TVal));
+
+    struct Shape {
+        TIdx blockSize;
+        TIdx m;
+        TIdx k;
+        TIdx n;
+    };
+    std::vector<Shape> shapes = {{8, 100, 64, 33},  {8, 20, 150, 70},
+                                 {4, 64, 17, 130},  {16, 130, 64, 130},
+                                 {8, 128, 40, 128}, {25, 30, 210, 90},
+                                 {16, 256, 64, 200}};
+    for (auto shape : shapes) {
+        for (auto schedule :
+             {cannon_schedule::outer_blocks, cannon_schedule::tiles}) {
+            for (auto backend :
+                 {execution_backend::device, execution_backend::host}) {
+                CAPTURE((int)schedule);
+                CAPTURE((int)backend);
+                setCannonSchedule(schedule);
+                setBackend(backend);
+                testProduct(shape.blockSize, shape.m, shape.k, shape.n, 1,
+                            stream_orientation::left_handed,
+                            stream_orientation::right_handed);
+            }
+        }
+    }
+    setBackend(execution_backend::device);
+
+    setCannonSchedule(cannon_schedule::tiles);
+}
+
 TEST_CASE("we can multiply two streamed matrices", "[streams]") {
     TIdx n = 256;
 
     DStreamingMatrix<TVal, TIdx> A(n);
     DStreamingMatrix<TVal, TIdx> B(n);
 
-    for (TIdx i = 0; i < n; ++i)
-        for (TIdx j = 0; j < n; ++j) {
-            A.at(i, j) = (float)i;
-            B.at(i, j) = (float)j;
-        }
-
-    A.getStream().setOrientation(stream_orientation::left_handed);
-    B.getStream().setOrientation(stream_orientation::right_handed);
+    A.generate([](TIdx i, TIdx) { return (float)i; });
+    B.generate([](TIdx, TIdx j) { return (float)j; });
 
     DStreamingMatrix<TVal, TIdx> C(n);
     C = A * B;
 
     REQUIRE(C.at(n - 1, n - 1) == 16646400.0f);
 }
+
+TEST_CASE("bulk fill and extract agree with element access", "[streams]") {
+    std::vector<TIdx> sizes = {16, 17, 50};
+    for (auto size : sizes) {
+        CAPTURE(size);
+        TIdx blockSize = size / (2 * stream_config::N);
+
+        std::vector<TVal> buffer(size * size);
+        for (TIdx i = 0; i < size * size; ++i)
+            buffer[i] = (TVal)i;
+
+        DStreamingMatrix<TVal, TIdx> A(blockSize, size);
+        DStreamingMatrix<TVal, TIdx> B(blockSize, size);
+        A.fill(buffer);
+        B.generate([size](TIdx i, TIdx j) { return (TVal)(i * size + j); });
+
+        for (TIdx i = 0; i < size; ++i)
+            for (TIdx j = 0; j < size; ++j) {
+                REQUIRE(A.at(i, j) == buffer[i * size + j]);
+                REQUIRE(B.at(i, j) == buffer[i * size + j]);
+            }
+
+        B.getStream().setOrientation(stream_orientation::right_handed);
+        std::vector<TVal> result;
+        B.extract(result);
+        CHECK(result == buffer);
+    }
+}
+
+TEST_CASE("the host backend multiplies streamed matrices", "[streams]") {
+    setBackend(execution_backend::host);
+
+    std::vector<TIdx> sizes = {16, 17, 33, 64};
+    for (auto size : sizes) {
+        CAPTURE(size);
+        TIdx blockSize = std::min((TIdx)32, size / (2 * stream_config::N));
+
+        std::vector<TVal> a(size * size);
+        std::vector<TVal> b(size * size);
+        DStreamingMatrix<TVal, TIdx> A(blockSize, size);
+        DStreamingMatrix<TVal, TIdx> B(blockSize, size);
+        for (TIdx i = 0; i < size; ++i)
+            for (TIdx j = 0; j < size; ++j) {
+                a[i * size + j] = (float)((i * 7 + j * 3) % 11) - 5.0f;
+                b[i * size + j] = (float)((i * 5 + j * 2) % 13) - 6.0f;
+                A.at(i, j) = a[i * size + j];
+                B.at(i, j) = b[i * size + j];
+            }
+        B.getStream().setOrientation(stream_orientation::right_handed);
+
+        DStreamingMatrix<TVal, TIdx> C(blockSize, size);
+        C = A * B;
+
+        for (TIdx i = 0; i < size; ++i)
+            for (TIdx j = 0; j < size; ++j) {
+                TVal expected = 0.0f;
+                for (TIdx k = 0; k < size; ++k)
+                    expected += a[i * size + k] * b[k * size + j];
+                CHECK(C.at(i, j) == expected);
+            }
+    }
+
+    setBackend(execution_backend::device);
+}
+
+TEST_CASE("products alias the up stream until the session reuses it",
+          "[streams]") {
+    TIdx n = 32;
+    DStreamingMatrix<TVal, TIdx> A(8, n);
+    DStreamingMatrix<TVal, TIdx> B(8, n);
+    A.generate([](TIdx i, TIdx) { return (float)i; });
+    B.generate([](TIdx, TIdx j) { return (float)j; });
+
+    DStreamingMatrix<TVal, TIdx> C(8, n);
+    C = A * B;
+    CHECK(C.getStream().isAliased());
+    CHECK(C.at(3, 5) == 15.0f * n);
+
+    DStreamingMatrix<TVal, TIdx> D(8, n);
+    D = A * B;
+    CHECK(C.at(3, 5) == 15.0f * n);
+    CHECK(D.at(2, 7) == 14.0f * n);
+
+    Session::instance().end();
+    CHECK(C.at(n - 1, n - 1) == (float)((n - 1) * (n - 1) * n));
+}
+
+TEST_CASE("copies of an aliased product have their own values",
+          "[streams]") {
+    TIdx n = 32;
+    DStreamingMatrix<TVal, TIdx> A(8, n);
+    DStreamingMatrix<TVal, TIdx> B(8, n);
+    A.generate([](TIdx i, TIdx) { return (float)i; });
+    B.generate([](TIdx, TIdx j) { return (float)j; });
+
+    DStreamingMatrix<TVal, TIdx> C(8, n);
+    C = A * B;
+    REQUIRE(C.getStream().isAliased());
+
+    DStreamingMatrix<TVal, TIdx> D = C;
+    D.generate([](TIdx, TIdx) { return 1.0f; });
+    CHECK(!D.getStream().isAliased());
+    CHECK(C.getStream().isAliased());
+    CHECK(C.at(3, 5) == 15.0f * n);
+    CHECK(D.at(3, 5) == 1.0f);
+
+    DStreamingMatrix<TVal, TIdx> E = C;
+    E.at(2, 7) = -1.0f;
+    CHECK(E.at(2, 7) == -1.0f);
+    CHECK(C.at(2, 7) == 14.0f * n);
+
+    Session::instance().end();
+}
+
+TEST_CASE("the session keeps the system running between products",
+          "[streams]") {
+    TIdx n = 32;
+    DStreamingMatrix<TVal, TIdx> A(8, n);
+    DStreamingMatrix<TVal, TIdx> B(8, n);
+    A.generate([](TIdx i, TIdx) { return (float)i; });
+    B.generate([](TIdx, TIdx j) { return (float)j; });
+
+    auto& session = Session::instance();
+    session.end();
+    session.resetStatistics();
+
+    DStreamingMatrix<TVal, TIdx> C(8, n);
+    C = A * B;
+    CHECK(session.isRunning());
+
+    // the second product streams the result of the first
+    B.generate([](TIdx, TIdx j) { return (float)(j + 1); });
+    DStreamingMatrix<TVal, TIdx> D(8, n);
+    D = C * B;
+
+    const auto& statistics = session.getStatistics();
+    CHECK(statistics.initializations == 1);
+    CHECK(statistics.runs == 2);
+    CHECK(statistics.streamsReused == statistics.streamsCreated);
+
+    float sum = 0.0f;
+    for (TIdx k = 0; k < n; ++k)
+        sum += (float)k;
+    CHECK(C.at(3, 5) == 15.0f * n);
+    CHECK(D.at(2, 7) == 2.0f * n * 8.0f * sum);
+    CHECK(D.at(n - 1, 0) == (float)((n - 1) * n) * sum);
+
+    session.end();
+}
+
+TEST_CASE("the session restarts the system when the kernel changes",
+          "[streams]") {
+    // products of inner blocks of 8 and of 16 run different kernels, the
+    // session only keeps the last of these loaded
+    TIdx n = 64;
+    auto& session = Session::instance();
+    session.end();
+    session.resetStatistics();
+
+    for (TIdx round = 0; round < 2; ++round) {
+        for (TIdx blockSize : {8u, 16u}) {
+            CAPTURE(round);
+            CAPTURE(blockSize);
+            DStreamingMatrix<TVal, TIdx> A(blockSize, n);
+            DStreamingMatrix<TVal, TIdx> B(blockSize, n);
+            A.generate([=](TIdx i, TIdx) { return (float)(i + round); });
+            B.generate([](TIdx, TIdx j) { return (float)j; });
+
+            DStreamingMatrix<TVal, TIdx> C(blockSize, n);
+            C = A * B;
+            CHECK(C.at(3, 5) == (float)((3 + round) * 5 * n));
+            CHECK(C.at(n - 1, 1) == (float)((n - 1 + round) * n));
+        }
+    }
+
+    const auto& statistics = session.getStatistics();
+    CHECK(statistics.runs == 4);
+    CHECK(statistics.initializations == 4);
+    CHECK(statistics.streamsReused == 0);
+
+    session.end();
+}
+
+TEST_CASE("submitted products run on the device thread", "[streams]") {
+    TIdx n = 32;
+    DStreamingMatrix<TVal, TIdx> A(8, n);
+    DStreamingMatrix<TVal, TIdx> B(8, n);
+    A.generate([](TIdx i, TIdx) { return (float)i; });
+    B.generate([](TIdx, TIdx j) { return (float)j; });
+    auto first = submit(A * B);
+
+    // the operands of the next product are prepared in the meantime
+    DStreamingMatrix<TVal, TIdx> D(8, n);
+    DStreamingMatrix<TVal, TIdx> E(8, n);
+    D.generate([](TIdx, TIdx) { return 1.0f; });
+    E.generate([](TIdx i, TIdx j) { return (float)(i + j); });
+    auto second = submit(D * E);
+
+    auto C = first.get();
+    auto F = second.get();
+    CHECK(!C.getStream().isAliased());
+    CHECK(C.at(3, 5) == 15.0f * n);
+    CHECK(F.at(0, 2) == (float)(n * (n - 1) / 2 + 2 * n));
+
+    // the session is released as soon as the last result is ready, and can
+    // be used by this thread again
+    CHECK(!Session::instance().isReserved());
+    DStreamingMatrix<TVal, TIdx> G(8, n);
+    G = A * B;
+    CHECK(G.at(3, 5) == 15.0f * n);
+
+    DeviceQueue::instance().wait();
+    Session::instance().end();
+}